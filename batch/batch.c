@@ -0,0 +1,312 @@
+#include "../d3d.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// The defaults for the command-line options:
+#define DEFAULT_WIDTH 160
+#define DEFAULT_HEIGHT 120
+#define DEFAULT_FOV_X ((d3d_scalar)2.0)
+#define DEFAULT_FOV_Y ((d3d_scalar)1.5)
+#define DEFAULT_EMPTY 0
+
+#define USAGE \
+	"Usage: %s [-w width] [-h height] [-x fovx] [-y fovy] [-e empty]\n" \
+	"          [-j threads] [-f pgm|raw] [-o output] level poses\n"
+
+// The state shared by all the rendering threads:
+struct output {
+	// The file to which frames are written:
+	FILE *file;
+	// Whether frames are written as PGM images (or else raw pixels):
+	bool pgm;
+	// Frames are written in order. This guards the members below:
+	pthread_mutex_t lock;
+	// This is signalled when next or failed changes:
+	pthread_cond_t turn;
+	// The index of the next frame to write:
+	size_t next;
+	// Whether writing failed, so all threads should stop:
+	bool failed;
+};
+
+// The state of one rendering thread:
+struct worker {
+	pthread_t thread;
+	struct output *out;
+	d3d_camera *cam;
+	const d3d_board *board;
+	size_t n_poses;
+	const d3d_pose_s *poses;
+	// The poses first, first + step, etc. are drawn:
+	size_t first, step;
+	// The frame is transposed into this since cameras store columns:
+	void *rows;
+};
+
+// Write the frame in the camera once all the frames before it are written.
+// This is the emit callback for d3d_render_batch.
+static int emit_frame(void *ctx, size_t index, d3d_camera *cam)
+{
+	struct worker *w = ctx;
+	struct output *out = w->out;
+	size_t width = d3d_camera_width(cam);
+	size_t height = d3d_camera_height(cam);
+	// Prepare the frame before waiting so that other threads can write:
+	size_t pixel_size = out->pgm ? 1 : sizeof(d3d_pixel);
+	for (size_t y = 0; y < height; ++y) {
+		for (size_t x = 0; x < width; ++x) {
+			d3d_pixel p = *d3d_camera_get(cam, x, y);
+			size_t i = y * width + x;
+			if (out->pgm) {
+				unsigned char *rows = w->rows;
+				rows[i] = (unsigned char)p;
+			} else {
+				d3d_pixel *rows = w->rows;
+				rows[i] = p;
+			}
+		}
+	}
+	pthread_mutex_lock(&out->lock);
+	while (!out->failed && out->next != index) {
+		pthread_cond_wait(&out->turn, &out->lock);
+	}
+	if (!out->failed) {
+		if ((out->pgm && fprintf(out->file, "P5\n%zu %zu\n255\n",
+				width, height) < 0)
+		 || fwrite(w->rows, pixel_size, width * height, out->file)
+		 	!= width * height) {
+			out->failed = true;
+		} else {
+			++out->next;
+		}
+		pthread_cond_broadcast(&out->turn);
+	}
+	bool failed = out->failed;
+	pthread_mutex_unlock(&out->lock);
+	return failed;
+}
+
+static void *work(void *arg)
+{
+	struct worker *w = arg;
+	d3d_render_batch(w->cam, w->board, w->n_poses, w->poses,
+		w->first, w->step, emit_frame, w);
+	return NULL;
+}
+
+// Read poses, one per line as "x y facing", from a file. Blank lines and lines
+// starting with # are skipped. NULL is returned on failure.
+static d3d_pose_s *read_poses(const char *path, size_t *n_poses)
+{
+	FILE *file = fopen(path, "r");
+	if (!file) return NULL;
+	d3d_pose_s *poses = NULL;
+	size_t n = 0, cap = 0;
+	char line[256];
+	unsigned long lineno = 0;
+	while (fgets(line, sizeof(line), file)) {
+		++lineno;
+		char *start = line + strspn(line, " \t\r\n");
+		if (*start == '\0' || *start == '#') continue;
+		double x, y, facing;
+		if (sscanf(start, "%lf %lf %lf", &x, &y, &facing) != 3) {
+			fprintf(stderr, "%s:%lu: expected x y facing\n",
+				path, lineno);
+			goto error;
+		}
+		if (n >= cap) {
+			cap = cap ? cap * 2 : 64;
+			d3d_pose_s *new_poses =
+				realloc(poses, cap * sizeof(*poses));
+			if (!new_poses) goto error;
+			poses = new_poses;
+		}
+		poses[n].pos.x = (d3d_scalar)x;
+		poses[n].pos.y = (d3d_scalar)y;
+		poses[n].facing = (d3d_scalar)facing;
+		++n;
+	}
+	if (ferror(file)) goto error;
+	fclose(file);
+	*n_poses = n;
+	return poses;
+
+error:
+	free(poses);
+	fclose(file);
+	return NULL;
+}
+
+static double seconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	size_t width = DEFAULT_WIDTH, height = DEFAULT_HEIGHT;
+	d3d_scalar fovx = DEFAULT_FOV_X, fovy = DEFAULT_FOV_Y;
+	d3d_pixel empty = DEFAULT_EMPTY;
+	long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	bool pgm = true;
+	const char *out_path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "w:h:x:y:e:j:f:o:")) != -1) {
+		switch (opt) {
+		case 'w':
+			width = strtoul(optarg, NULL, 10);
+			break;
+		case 'h':
+			height = strtoul(optarg, NULL, 10);
+			break;
+		case 'x':
+			fovx = (d3d_scalar)strtod(optarg, NULL);
+			break;
+		case 'y':
+			fovy = (d3d_scalar)strtod(optarg, NULL);
+			break;
+		case 'e':
+			empty = (d3d_pixel)strtol(optarg, NULL, 0);
+			break;
+		case 'j':
+			n_threads = strtol(optarg, NULL, 10);
+			break;
+		case 'f':
+			if (!strcmp(optarg, "pgm")) {
+				pgm = true;
+			} else if (!strcmp(optarg, "raw")) {
+				pgm = false;
+			} else {
+				fprintf(stderr, USAGE, argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		default:
+			fprintf(stderr, USAGE, argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (argc - optind != 2 || width < 1 || height < 1) {
+		fprintf(stderr, USAGE, argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (n_threads < 1) n_threads = 1;
+	const char *level_path = argv[optind], *poses_path = argv[optind + 1];
+
+	// Map the level so that it is used without being read or parsed:
+	int fd = open(level_path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(level_path);
+		return EXIT_FAILURE;
+	}
+	size_t level_size = (size_t)st.st_size;
+	if (level_size == 0) {
+		fprintf(stderr, "%s: invalid level\n", level_path);
+		return EXIT_FAILURE;
+	}
+	void *data =
+		mmap(NULL, level_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		perror(level_path);
+		return EXIT_FAILURE;
+	}
+	d3d_level *level = d3d_load_level(data, level_size);
+	if (!level) {
+		fprintf(stderr, "%s: invalid level\n", level_path);
+		return EXIT_FAILURE;
+	}
+	size_t n_poses;
+	errno = 0;
+	d3d_pose_s *poses = read_poses(poses_path, &n_poses);
+	if (!poses) {
+		if (errno) perror(poses_path);
+		return EXIT_FAILURE;
+	}
+
+	struct output out = {
+		.file = out_path ? fopen(out_path, "wb") : stdout,
+		.pgm = pgm,
+		.next = 0,
+		.failed = false,
+	};
+	if (!out.file) {
+		perror(out_path);
+		return EXIT_FAILURE;
+	}
+	pthread_mutex_init(&out.lock, NULL);
+	pthread_cond_init(&out.turn, NULL);
+
+	// Each thread draws every n_threads-th pose with its own camera:
+	size_t pixel_size = pgm ? 1 : sizeof(d3d_pixel);
+	struct worker *workers = calloc((size_t)n_threads, sizeof(*workers));
+	if (!workers) {
+		perror(argv[0]);
+		return EXIT_FAILURE;
+	}
+	double start = seconds();
+	long n_started = 0;
+	for (long i = 0; i < n_threads; ++i) {
+		struct worker *w = &workers[i];
+		w->out = &out;
+		w->cam = d3d_new_camera(fovx, fovy, width, height, empty);
+		w->rows = malloc(width * height * pixel_size);
+		w->board = d3d_level_board(level);
+		w->n_poses = n_poses;
+		w->poses = poses;
+		w->first = (size_t)i;
+		w->step = (size_t)n_threads;
+		if (!w->cam || !w->rows
+		 || pthread_create(&w->thread, NULL, work, w)) {
+			d3d_free_camera(w->cam);
+			free(w->rows);
+			// Let the running threads finish:
+			pthread_mutex_lock(&out.lock);
+			out.failed = true;
+			pthread_cond_broadcast(&out.turn);
+			pthread_mutex_unlock(&out.lock);
+			break;
+		}
+		++n_started;
+	}
+	for (long i = 0; i < n_started; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		d3d_free_camera(workers[i].cam);
+		free(workers[i].rows);
+	}
+	double elapsed = seconds() - start;
+	if (fflush(out.file) != 0) out.failed = true;
+	if (out.file != stdout) fclose(out.file);
+
+	int status = EXIT_SUCCESS;
+	if (out.failed) {
+		fprintf(stderr, "%s: failed to write frames\n", argv[0]);
+		status = EXIT_FAILURE;
+	}
+	fprintf(stderr, "%zu frames in %.3f s (%.1f frames/second, %ld threads)\n",
+		out.next, elapsed, elapsed > 0 ? out.next / elapsed : 0.0,
+		n_started);
+
+	pthread_cond_destroy(&out.turn);
+	pthread_mutex_destroy(&out.lock);
+	free(workers);
+	free(poses);
+	d3d_free_level(level);
+	munmap(data, level_size);
+	return status;
+}
@@ -6,6 +6,7 @@
 #endif
 #include <tgmath.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -38,7 +39,21 @@
 		(grid)->height ? \
 	&(grid)->member[((size_t)(y) + (grid)->height * (size_t)(x))] : NULL)
 
-#define PI ((d3d_scalar)3.14159265358979323846)
+// The scalar type used for computations inside the library, and vectors of it.
+// These are d3d_scalar and an equivalent of d3d_vec_s unless the option
+// D3D_INTERNAL_SCALAR_TYPE is set.
+typedef d3d_internal_scalar scalar;
+typedef d3d_internal_vec_s vec_s;
+
+#define PI ((scalar)3.14159265358979323846)
+
+// Marks a function which should always be inlined, so that constant arguments
+// to it can be folded away.
+#ifdef __GNUC__
+#	define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#	define ALWAYS_INLINE inline
+#endif
 
 #ifndef D3D_CUSTOM_ALLOCATOR
 void *d3d_malloc(size_t size)
@@ -57,11 +72,185 @@ void d3d_free(void *mem)
 }
 #endif
 
+static void *default_alloc(void *ctx, size_t size)
+{
+	(void)ctx;
+	return d3d_malloc(size);
+}
+
+static void *default_resize(void *ctx, void *mem, size_t old_size, size_t size)
+{
+	(void)ctx;
+	(void)old_size;
+	return d3d_realloc(mem, size);
+}
+
+static void default_release(void *ctx, void *mem)
+{
+	(void)ctx;
+	d3d_free(mem);
+}
+
+// The allocator used when none is given, which uses d3d_malloc and friends.
+static const d3d_allocator_s default_allocator = {
+	default_alloc, default_resize, default_release, NULL
+};
+
+// Get the allocator to use when alloc is given, which may be NULL.
+static const d3d_allocator_s *pick_allocator(const d3d_allocator_s *alloc)
+{
+	return alloc ? alloc : &default_allocator;
+}
+
+// Allocate memory from an allocator.
+static void *allocate(const d3d_allocator_s *alloc, size_t size)
+{
+	return alloc->alloc(alloc->ctx, size);
+}
+
+// Give memory back to an allocator. The memory may be NULL.
+static void release(const d3d_allocator_s *alloc, void *mem)
+{
+	if (mem) alloc->release(alloc->ctx, mem);
+}
+
+// A type as strictly aligned as any basic type. Arena allocations are aligned
+// like it.
+union arena_align {
+	long double ld;
+	long long ll;
+	void *p;
+	void (*f)(void);
+};
+
+// The size of a block header in an arena, after which the memory starts.
+#define ARENA_HEADER ((sizeof(struct d3d_arena_block) \
+	+ ALIGNOF(union arena_align) - 1) \
+	/ ALIGNOF(union arena_align) * ALIGNOF(union arena_align))
+
+d3d_arena *d3d_new_arena(size_t block_size)
+{
+	d3d_arena *arena = d3d_malloc(sizeof(*arena));
+	if (!arena) return NULL;
+	arena->block_size = block_size > 0 ? block_size : 1;
+	arena->blocks = NULL;
+	arena->last = NULL;
+	return arena;
+}
+
+static void *arena_alloc(void *ctx, size_t size)
+{
+	d3d_arena *arena = ctx;
+	struct d3d_arena_block *head = arena->blocks;
+	size_t align = ALIGNOF(union arena_align);
+	if (size == 0) size = 1;
+	if (size > SIZE_MAX - align) return NULL;
+	size = (size + align - 1) / align * align;
+	if (!head || head->size - head->used < size) {
+		// A new block is needed. Allocations bigger than the usual
+		// block size get blocks of their own:
+		size_t block_size =
+			size > arena->block_size ? size : arena->block_size;
+		if (block_size > SIZE_MAX - ARENA_HEADER) return NULL;
+		struct d3d_arena_block *block =
+			d3d_malloc(ARENA_HEADER + block_size);
+		if (!block) return NULL;
+		block->size = block_size;
+		block->used = 0;
+		if (head && block_size > arena->block_size) {
+			// Keep using the space left in the head:
+			block->next = head->next;
+			head->next = block;
+			block->used = size;
+			return (char *)block + ARENA_HEADER;
+		}
+		block->next = head;
+		arena->blocks = head = block;
+	}
+	void *mem = (char *)head + ARENA_HEADER + head->used;
+	head->used += size;
+	arena->last = mem;
+	return mem;
+}
+
+static void *arena_resize(void *ctx, void *mem, size_t old_size, size_t size)
+{
+	d3d_arena *arena = ctx;
+	struct d3d_arena_block *head = arena->blocks;
+	if (!mem) return arena_alloc(ctx, size);
+	if (mem == arena->last) {
+		// The latest allocation can grow or shrink in place:
+		size_t start = (char *)mem - ((char *)head + ARENA_HEADER);
+		if (size <= head->size - start) {
+			size_t align = ALIGNOF(union arena_align);
+			head->used = start
+				+ ((size ? size : 1) + align - 1) / align * align;
+			if (head->used > head->size) head->used = head->size;
+			return mem;
+		}
+	}
+	void *new_mem = arena_alloc(ctx, size);
+	if (new_mem) memcpy(new_mem, mem, old_size < size ? old_size : size);
+	return new_mem;
+}
+
+static void arena_release(void *ctx, void *mem)
+{
+	d3d_arena *arena = ctx;
+	// Only the latest allocation is given back; the rest waits for the
+	// arena to be freed:
+	if (mem == arena->last) {
+		struct d3d_arena_block *head = arena->blocks;
+		head->used = (char *)mem - ((char *)head + ARENA_HEADER);
+		arena->last = NULL;
+	}
+}
+
+d3d_allocator_s d3d_arena_allocator(d3d_arena *arena)
+{
+	d3d_allocator_s alloc = {
+		arena_alloc, arena_resize, arena_release, arena
+	};
+	return alloc;
+}
+
+void d3d_free_arena(d3d_arena *arena)
+{
+	if (!arena) return;
+	struct d3d_arena_block *block = arena->blocks;
+	while (block) {
+		struct d3d_arena_block *next = block->next;
+		d3d_free(block);
+		block = next;
+	}
+	d3d_free(arena);
+}
+
 static d3d_pixel camera_empty_pixel(d3d_camera *cam)
 {
 	return cam->blank_block.faces[0]->pixels[0];
 }
 
+// Get the shading table for things dist away from a camera, or NULL if the
+// camera has no shading.
+static const d3d_pixel *band_lut(const d3d_camera *cam, scalar dist)
+{
+	if (cam->n_bands == 0) return NULL;
+	scalar band = dist / cam->band_depth;
+	size_t b = band < cam->n_bands ? (size_t)band : cam->n_bands - 1;
+	return &cam->luts[b * cam->lut_size];
+}
+
+// Shade a pixel with a table from band_lut, which may be NULL. Pixels which
+// are not covered by the table are left alone.
+static d3d_pixel shade(
+	const d3d_camera *cam,
+	const d3d_pixel *lut,
+	d3d_pixel p)
+{
+	return lut && (size_t)p < cam->lut_size ? lut[(size_t)p] : p;
+}
+
 static void empty_camera_pixels(d3d_camera *cam)
 {
 	d3d_pixel empty_pixel = camera_empty_pixel(cam);
@@ -70,37 +259,97 @@ static void empty_camera_pixels(d3d_camera *cam)
 	}
 }
 
+// Get the offset of the pixels from the start of a texture when they are glued
+// on after it.
+static size_t texture_pixels_offset(void)
+{
+	return (sizeof(d3d_texture) + ALIGNOF(d3d_pixel) - 1)
+		/ ALIGNOF(d3d_pixel) * ALIGNOF(d3d_pixel);
+}
+
+// Get a level of detail for picking mipmap levels when each screen pixel covers
+// about footprint blocks worth of length. This is about log2(footprint), kept
+// in a range where adding texture sizes can't overflow.
+static int lod_of(scalar footprint)
+{
+	if (!(footprint < (scalar)1e18)) return 64;
+	if (!(footprint > (scalar)1e-18)) return -64;
+	return ilogb(footprint);
+}
+
+// Initialize the members of a texture whose pixels are already allocated. Any
+// mipmaps will come from alloc.
+static void init_texture(
+	d3d_texture *txtr,
+	size_t width,
+	size_t height,
+	d3d_pixel *pixels,
+	const d3d_allocator_s *alloc)
+{
+	txtr->alloc = *alloc;
+	txtr->width = width;
+	txtr->height = height;
+	txtr->pixels = pixels;
+	txtr->mips = NULL;
+	txtr->n_mips = 0;
+	txtr->size_log2 = 0;
+	txtr->pow2 = (width & (width - 1)) == 0 && (height & (height - 1)) == 0;
+	txtr->wmask = width - 1;
+	txtr->hmask = height - 1;
+	txtr->hshift = 0;
+	while ((size_t)1 << txtr->hshift < height) ++txtr->hshift;
+}
+
+// Get a pointer to the texel at a position in a texture, or NULL if the
+// position is out of range. Positions on power-of-two textures wrap around
+// instead, which needs no comparisons.
+static const d3d_pixel *texel(const d3d_texture *txtr, size_t x, size_t y)
+{
+	if (txtr->pow2) {
+		return &txtr->pixels[(x & txtr->wmask) << txtr->hshift
+			| (y & txtr->hmask)];
+	}
+	return GET(txtr, pixels, x, y);
+}
+
 static size_t texture_size(size_t width, size_t height)
 {
 	size_t pixels_size = width * height * sizeof(d3d_pixel);
 	if (pixels_size / sizeof(d3d_pixel) / width != height) return 0;
-	size_t base = offsetof(d3d_texture, pixels);
+	size_t base = texture_pixels_offset();
 	size_t size = base + pixels_size;
 	if (base > size) return 0;
 	return size;
 }
 
+// Convert a public vector to the internal type.
+static vec_s to_vec(d3d_vec_s v)
+{
+	vec_s converted = { v.x, v.y };
+	return converted;
+}
+
 // Computes fmod(n, 1.0) if n >= 0, or 1.0 + fmod(n, 1.0) if n < 0
 // Returns in the range [0, 1)
-static d3d_scalar mod1(d3d_scalar n)
+static scalar mod1(scalar n)
 {
 	return n - floor(n);
 }
 
 // computes approximately 1.0 - fmod(n, 1.0) if n >= 0 or -fmod(n, 1.0) if n < 0
 // Returns in the range [0, 1)
-static d3d_scalar revmod1(d3d_scalar n)
+static scalar revmod1(scalar n)
 {
 	return ceil(n) - n;
 }
 
 // Compute the difference between the two angles (each themselves between 0 and
 // 2π.) The result is between -π and π.
-static d3d_scalar angle_diff(d3d_scalar a1, d3d_scalar a2)
+static scalar angle_diff(scalar a1, scalar a2)
 {
-	d3d_scalar diff = a1 - a2;
+	scalar diff = a1 - a2;
 	if (diff > PI) return -2 * PI + diff;
-	if (diff < -PI) return -diff - 2 * PI;
+	if (diff < -PI) return diff + 2 * PI;
 	return diff;
 }
 
@@ -110,10 +359,10 @@ static d3d_scalar angle_diff(d3d_scalar a1, d3d_scalar a2)
 // coordinates of a moving point hitting a wall. If it hits a wall going in the
 // positive direction, it would be put in the tile one over except for the
 // decrement.
-static size_t tocoord(d3d_scalar c, bool positive)
+static size_t tocoord(scalar c, bool positive)
 {
-	d3d_scalar f = floor(c);
-	if (positive && f == c && c != (d3d_scalar)0.0) return (size_t)c - 1;
+	scalar f = floor(c);
+	if (positive && f == c && c != (scalar)0.0) return (size_t)c - 1;
 	return f;
 }
 
@@ -149,9 +398,22 @@ d3d_camera *d3d_new_camera(
 	size_t width,
 	size_t height,
 	d3d_pixel empty_pixel)
+{
+	return d3d_new_camera_with(fovx, fovy, width, height, empty_pixel,
+		NULL);
+}
+
+d3d_camera *d3d_new_camera_with(
+	d3d_scalar fovx,
+	d3d_scalar fovy,
+	size_t width,
+	size_t height,
+	d3d_pixel empty_pixel,
+	const d3d_allocator_s *alloc)
 {
 	size_t size;
-	size_t pixels_size, txtr_offset, tans_offset, dists_offset;
+	size_t pixels_size, txtr_offset, fog_offset, tans_offset, dists_offset;
+	size_t lods_offset;
 	d3d_texture *empty_txtr;
 	d3d_camera *cam;
 	size = offsetof(d3d_camera, pixels);
@@ -159,28 +421,37 @@ d3d_camera *d3d_new_camera(
 	if (width != 0 && pixels_size / sizeof(d3d_pixel) / width != height)
 		return NULL;
 	CHECKED_ADD(size, pixels_size);
-	// This type probably has the alignment of a one-pixel texture:
-	typedef struct { size_t width, height; d3d_pixel pixels[1]; } one_pix;
-	ALIGN_SIZE(size, one_pix);
+	ALIGN_SIZE(size, d3d_texture);
 	txtr_offset = size;
 	CHECKED_ADD(size, texture_size(1, 1));
-	ALIGN_SIZE(size, d3d_scalar);
+	ALIGN_SIZE(size, d3d_texture);
+	fog_offset = size;
+	CHECKED_ADD(size, texture_size(1, 1));
+	ALIGN_SIZE(size, scalar);
 	tans_offset = size;
-	if (height * sizeof(d3d_scalar) / sizeof(d3d_scalar) != height)
+	if (height * sizeof(scalar) / sizeof(scalar) != height)
 		return NULL;
-	CHECKED_ADD(size, height * sizeof(d3d_scalar));
+	CHECKED_ADD(size, height * sizeof(scalar));
 	dists_offset = size;
-	if (width * sizeof(d3d_scalar) / sizeof(d3d_scalar) != width)
+	if (width * sizeof(scalar) / sizeof(scalar) != width)
 		return NULL;
-	CHECKED_ADD(size, width * sizeof(d3d_scalar));
-	cam = d3d_malloc(size);
+	CHECKED_ADD(size, width * sizeof(scalar));
+	ALIGN_SIZE(size, int);
+	lods_offset = size;
+	if (height * sizeof(int) / sizeof(int) != height) return NULL;
+	CHECKED_ADD(size, height * sizeof(int));
+	alloc = pick_allocator(alloc);
+	cam = allocate(alloc, size);
 	if (!cam) return NULL;
+	cam->alloc = *alloc;
 	// The members 'tans' and 'dists' are actually pointers to parts of the
 	// same allocation. 'empty_txtr' is glued on before them, but is not a
-	// member.
+	// member. Neither is 'fog', which comes after it.
 	empty_txtr = (void *)((char *)cam + txtr_offset);
+	cam->fog = (void *)((char *)cam + fog_offset);
 	cam->tans = (void *)((char *)cam + tans_offset);
 	cam->dists = (void *)((char *)cam + dists_offset);
+	cam->row_lods = (void *)((char *)cam + lods_offset);
 	// Just do basic protection against non-positive FOVs as they might
 	// cause issues. I could do something better than silently clamping, but
 	// what do you expect a non-positive FOV to do anyway?
@@ -188,9 +459,23 @@ d3d_camera *d3d_new_camera(
 	cam->fov.y = fovy > (d3d_scalar)0.0 ? fovy : 0.001;
 	cam->width = width;
 	cam->height = height;
-	empty_txtr->width = 1;
-	empty_txtr->height = 1;
+	// The angle between neighbouring pixels, in whichever direction they
+	// are farther apart:
+	cam->lod_scale = fmax(cam->fov.x / (width ? width : 1),
+		cam->fov.y / (height ? height : 1));
+	init_texture(empty_txtr, 1, 1,
+		(void *)((char *)empty_txtr + texture_pixels_offset()), alloc);
 	empty_txtr->pixels[0] = empty_pixel;
+	init_texture(cam->fog, 1, 1,
+		(void *)((char *)cam->fog + texture_pixels_offset()), alloc);
+	cam->fog->pixels[0] = empty_pixel;
+	cam->max_dist = INFINITY;
+	cam->fog_tan = 0;
+	cam->n_bands = 0;
+	cam->lut_size = 0;
+	cam->band_depth = 1;
+	cam->luts = NULL;
+	cam->row_luts = NULL;
 	cam->blank_block.faces[D3D_DPOSX] =
 	cam->blank_block.faces[D3D_DPOSY] =
 	cam->blank_block.faces[D3D_DNEGX] =
@@ -201,52 +486,339 @@ d3d_camera *d3d_new_camera(
 	cam->order_buf_cap = 0;
 	cam->last_sprites = NULL;
 	cam->last_n_sprites = 0;
+	cam->last_index = NULL;
+	cam->n_sprites_drawn = 0;
 	empty_camera_pixels(cam);
 	for (size_t y = 0; y < height; ++y) {
-		d3d_scalar angle =
-			cam->fov.y * ((d3d_scalar)0.5 - (d3d_scalar)y / height);
+		scalar angle =
+			cam->fov.y * ((scalar)0.5 - (scalar)y / height);
 		cam->tans[y] = tan(angle);
+		// This is the distance at which a floor or ceiling is seen in
+		// this row:
+		scalar row_dist = (scalar)0.5 / fabs(cam->tans[y]);
+		cam->row_lods[y] = lod_of(row_dist * cam->lod_scale);
 	}
 	return cam;
 }
 
+void d3d_camera_set_view_dist(
+	d3d_camera *cam,
+	d3d_scalar max_dist,
+	d3d_pixel fog_pixel)
+{
+	cam->fog->pixels[0] = fog_pixel;
+	if (max_dist > (d3d_scalar)0.0) {
+		cam->max_dist = max_dist;
+		// Floors and ceilings are 0.5 away vertically, so they are too
+		// far in rows with smaller tangents than this:
+		cam->fog_tan = (scalar)0.5 / cam->max_dist;
+	} else {
+		cam->max_dist = INFINITY;
+		cam->fog_tan = 0;
+	}
+}
+
+int d3d_camera_set_shading(
+	d3d_camera *cam,
+	size_t n_bands,
+	d3d_scalar band_depth,
+	size_t lut_size,
+	const d3d_pixel luts[])
+{
+	const d3d_pixel **row_luts = NULL;
+	if (n_bands > 0 && lut_size > 0) {
+		if (!(band_depth > (d3d_scalar)0.0)) return -1;
+		// The row tables come first, then the shading tables:
+		size_t luts_offset = cam->height * sizeof(*row_luts);
+		if (luts_offset / sizeof(*row_luts) != cam->height) return -1;
+		luts_offset = (luts_offset + ALIGNOF(d3d_pixel) - 1)
+			/ ALIGNOF(d3d_pixel) * ALIGNOF(d3d_pixel);
+		size_t luts_size = n_bands * lut_size;
+		if (luts_size / lut_size != n_bands
+		 || luts_size * sizeof(d3d_pixel) / sizeof(d3d_pixel)
+		 	!= luts_size) return -1;
+		luts_size *= sizeof(d3d_pixel);
+		if (luts_offset + luts_size < luts_offset) return -1;
+		row_luts = allocate(&cam->alloc, luts_offset + luts_size);
+		if (!row_luts) return -1;
+		release(&cam->alloc, cam->row_luts);
+		cam->row_luts = row_luts;
+		cam->luts = (void *)((char *)row_luts + luts_offset);
+		memcpy(cam->luts, luts, luts_size);
+		cam->n_bands = n_bands;
+		cam->lut_size = lut_size;
+		cam->band_depth = band_depth;
+		// Floors and ceilings are at a fixed distance in each row:
+		for (size_t y = 0; y < cam->height; ++y) {
+			cam->row_luts[y] = band_lut(cam,
+				(scalar)0.5 / fabs(cam->tans[y]));
+		}
+	} else {
+		release(&cam->alloc, cam->row_luts);
+		cam->row_luts = NULL;
+		cam->luts = NULL;
+		cam->n_bands = 0;
+		cam->lut_size = 0;
+	}
+	return 0;
+}
+
 void d3d_free_camera(d3d_camera *cam)
 {
 	if (!cam) return;
-	d3d_free(cam->order);
+	release(&cam->alloc, cam->order);
+	release(&cam->alloc, cam->row_luts);
 	// 'tans' and 'dists' are freed here too:
-	d3d_free(cam);
+	release(&cam->alloc, cam);
 }
 
 d3d_texture *d3d_new_texture(size_t width, size_t height, d3d_pixel fill)
+{
+	return d3d_new_texture_with(width, height, fill, NULL);
+}
+
+d3d_texture *d3d_new_texture_with(
+	size_t width,
+	size_t height,
+	d3d_pixel fill,
+	const d3d_allocator_s *alloc)
 {
 	if (width < 1) width = 1;
 	if (height < 1) height = 1;
 	size_t size = texture_size(width, height);
 	if (size == 0) return NULL;
-	d3d_texture *txtr = d3d_malloc(size);
+	alloc = pick_allocator(alloc);
+	d3d_texture *txtr = allocate(alloc, size);
 	if (!txtr) return NULL;
-	txtr->width = width;
-	txtr->height = height;
+	// The pixels are glued on after the structure:
+	init_texture(txtr, width, height,
+		(void *)((char *)txtr + texture_pixels_offset()), alloc);
 	for (size_t i = 0; i < width * height; ++i) {
 		txtr->pixels[i] = fill;
 	}
 	return txtr;
 }
 
+// Free the mipmap chain of a texture, if it has one.
+static void free_mips(d3d_texture *txtr)
+{
+	// The whole chain is one allocation starting with the first level:
+	release(&txtr->alloc, txtr->mips);
+	txtr->mips = NULL;
+	txtr->n_mips = 0;
+}
+
+int d3d_texture_build_mips(
+	d3d_texture *txtr,
+	d3d_pixel (*reduce)(void *ctx, const d3d_pixel square[4]),
+	void *ctx)
+{
+	size_t size, n_levels = 0, pixels_offset;
+	free_mips(txtr);
+	// Count the levels and add up their sizes. Each level is half the size
+	// of the last, rounded up, down to 1 by 1:
+	size_t width = txtr->width, height = txtr->height;
+	while (width > 1 || height > 1) {
+		width = (width + 1) / 2;
+		height = (height + 1) / 2;
+		++n_levels;
+	}
+	if (n_levels == 0) return 0;
+	// This can't overflow as the texture itself was bigger:
+	size = n_levels * sizeof(d3d_texture);
+	size = (size + ALIGNOF(d3d_pixel) - 1) / ALIGNOF(d3d_pixel)
+		* ALIGNOF(d3d_pixel);
+	pixels_offset = size;
+	width = txtr->width;
+	height = txtr->height;
+	for (size_t i = 0; i < n_levels; ++i) {
+		width = (width + 1) / 2;
+		height = (height + 1) / 2;
+		size += width * height * sizeof(d3d_pixel);
+	}
+	d3d_texture *levels = allocate(&txtr->alloc, size);
+	if (!levels) return -1;
+	d3d_pixel *pixels = (void *)((char *)levels + pixels_offset);
+	const d3d_texture *from = txtr;
+	for (size_t i = 0; i < n_levels; ++i) {
+		d3d_texture *to = &levels[i];
+		init_texture(to, (from->width + 1) / 2, (from->height + 1) / 2,
+			pixels, &txtr->alloc);
+		pixels += to->width * to->height;
+		for (size_t x = 0; x < to->width; ++x) {
+			// Squares at odd edges repeat the last row or column:
+			size_t x0 = x * 2, x1 = x0 + 1 < from->width ? x0 + 1 : x0;
+			for (size_t y = 0; y < to->height; ++y) {
+				size_t y0 = y * 2;
+				size_t y1 = y0 + 1 < from->height ? y0 + 1 : y0;
+				d3d_pixel square[4] = {
+					*GET(from, pixels, x0, y0),
+					*GET(from, pixels, x1, y0),
+					*GET(from, pixels, x0, y1),
+					*GET(from, pixels, x1, y1)
+				};
+				*GET(to, pixels, x, y) = reduce(ctx, square);
+			}
+		}
+		from = to;
+	}
+	txtr->mips = levels;
+	txtr->n_mips = n_levels;
+	txtr->size_log2 = lod_of(txtr->width > txtr->height ?
+		txtr->width : txtr->height);
+	return 0;
+}
+
+// Pick the level of a texture's mipmap chain to sample given a level of detail
+// from lod_of. The level chosen has at most about one texel per pixel so that
+// nearby pixels read nearby texels.
+static const d3d_texture *pick_mip(const d3d_texture *txtr, int lod)
+{
+	int level = lod + txtr->size_log2;
+	if (level < 1) return txtr;
+	// The levels are all next to each other, with level n at index n - 1:
+	if ((size_t)level > txtr->n_mips) level = txtr->n_mips;
+	return &txtr->mips[level - 1];
+}
+
+// The alignment in bytes of the pixels of each texture in an atlas. This is the
+// usual cache line size.
+#define ATLAS_ALIGN 64
+
+d3d_texture_atlas *d3d_new_texture_atlas(
+	size_t n_textures,
+	const size_t widths[],
+	const size_t heights[],
+	d3d_pixel fill)
+{
+	return d3d_new_texture_atlas_with(n_textures, widths, heights, fill,
+		NULL);
+}
+
+d3d_texture_atlas *d3d_new_texture_atlas_with(
+	size_t n_textures,
+	const size_t widths[],
+	const size_t heights[],
+	d3d_pixel fill,
+	const d3d_allocator_s *alloc)
+{
+	size_t size, textures_offset, pixels_offset;
+	size = sizeof(d3d_texture_atlas);
+	ALIGN_SIZE(size, d3d_texture);
+	textures_offset = size;
+	if (n_textures > SIZE_MAX / sizeof(d3d_texture)) return NULL;
+	CHECKED_ADD(size, n_textures * sizeof(d3d_texture));
+	// Room for aligning the start of the pixels, wherever the allocation
+	// starts:
+	CHECKED_ADD(size, ATLAS_ALIGN - 1);
+	pixels_offset = size;
+	// Each texture then takes a whole number of aligned blocks, as below:
+	for (size_t i = 0; i < n_textures; ++i) {
+		size_t width = widths[i] ? widths[i] : 1;
+		size_t height = heights[i] ? heights[i] : 1;
+		if (height > SIZE_MAX / sizeof(d3d_pixel) / width) return NULL;
+		size_t pixels_size = width * height * sizeof(d3d_pixel);
+		if (pixels_size > SIZE_MAX - (ATLAS_ALIGN - 1)) return NULL;
+		pixels_size = (pixels_size + ATLAS_ALIGN - 1)
+			/ ATLAS_ALIGN * ATLAS_ALIGN;
+		CHECKED_ADD(size, pixels_size);
+	}
+	alloc = pick_allocator(alloc);
+	d3d_texture_atlas *atlas = allocate(alloc, size);
+	if (!atlas) return NULL;
+	atlas->alloc = *alloc;
+	atlas->n_textures = n_textures;
+	atlas->textures = (void *)((char *)atlas + textures_offset);
+	// Offsets after this point are aligned absolutely, not relative to the
+	// start of the allocation. Rounding down is fine since ATLAS_ALIGN - 1
+	// bytes were reserved before pixels_offset:
+	uintptr_t addr = (uintptr_t)((char *)atlas + pixels_offset)
+		/ ATLAS_ALIGN * ATLAS_ALIGN;
+	uintptr_t end = (uintptr_t)((char *)atlas + size);
+	for (size_t i = 0; i < n_textures; ++i) {
+		d3d_texture *txtr = &atlas->textures[i];
+		size_t width = widths[i] ? widths[i] : 1;
+		size_t height = heights[i] ? heights[i] : 1;
+		size_t pixels_size = width * height * sizeof(d3d_pixel);
+		// This holds given the sizes above, but is cheap to check:
+		if (addr > end || pixels_size > end - addr) {
+			release(alloc, atlas);
+			return NULL;
+		}
+		init_texture(txtr, width, height, (d3d_pixel *)addr, alloc);
+		for (size_t p = 0; p < width * height; ++p) {
+			txtr->pixels[p] = fill;
+		}
+		addr += (pixels_size + ATLAS_ALIGN - 1)
+			/ ATLAS_ALIGN * ATLAS_ALIGN;
+	}
+	return atlas;
+}
+
+size_t d3d_atlas_n_textures(const d3d_texture_atlas *atlas)
+{
+	return atlas->n_textures;
+}
+
+d3d_texture *d3d_atlas_texture(d3d_texture_atlas *atlas, size_t i)
+{
+	return i < atlas->n_textures ? &atlas->textures[i] : NULL;
+}
+
+void d3d_free_texture_atlas(d3d_texture_atlas *atlas)
+{
+	if (!atlas) return;
+	for (size_t i = 0; i < atlas->n_textures; ++i) {
+		free_mips(&atlas->textures[i]);
+	}
+	release(&atlas->alloc, atlas);
+}
+
+// The block used for empty board spaces when no other is given.
+static const d3d_block_s empty_block = {{ NULL, NULL, NULL, NULL, NULL, NULL }};
+
+// Initialize the members of a board as those of an unaccelerated board storing
+// block pointers. Its memory comes from alloc.
+static void init_board(
+	d3d_board *board,
+	size_t width,
+	size_t height,
+	const d3d_allocator_s *alloc)
+{
+	board->alloc = *alloc;
+	board->width = width;
+	board->height = height;
+	board->accel = NULL;
+	board->index_size = 0;
+	board->n_palette = 0;
+	board->indices = NULL;
+	board->chunks = NULL;
+	board->n_ceilings = 0;
+	board->n_floors = 0;
+	board->pvs = NULL;
+	board->pvs_runs = NULL;
+}
+
 d3d_board *d3d_new_board(size_t width, size_t height, const d3d_block_s *fill)
+{
+	return d3d_new_board_with(width, height, fill, NULL);
+}
+
+d3d_board *d3d_new_board_with(
+	size_t width,
+	size_t height,
+	const d3d_block_s *fill,
+	const d3d_allocator_s *alloc)
 {
 	size_t size = offsetof(d3d_board, blocks);
 	size_t blocks_size = width * height * sizeof(d3d_block_s *);
 	if (width != 0 && blocks_size / sizeof(d3d_block_s *) / width != height)
 		return NULL;
 	CHECKED_ADD(size, blocks_size);
-	d3d_board *board = d3d_malloc(size);
+	alloc = pick_allocator(alloc);
+	d3d_board *board = allocate(alloc, size);
 	if (!board) return NULL;
-	board->width = width;
-	board->height = height;
-	static const d3d_block_s empty_block = {{ NULL, NULL, NULL, NULL,
-		NULL, NULL }};
+	init_board(board, width, height, alloc);
 	if (!fill) fill = &empty_block;
 	for (size_t i = 0; i < width * height; ++i) {
 		board->blocks[i] = fill;
@@ -254,213 +826,892 @@ d3d_board *d3d_new_board(size_t width, size_t height, const d3d_block_s *fill)
 	return board;
 }
 
-// Move the position pos by dpos (delta position) until a wall is hit. dir is
-// set to the face of the block which was hit. If no block is hit, NULL is
-// returned.
-static const d3d_block_s *hit_wall(
-	const d3d_board *board,
-	d3d_vec_s *pos,
-	const d3d_vec_s *dpos,
-	d3d_direction *dir,
-	const d3d_texture **txtr)
+d3d_board *d3d_new_palette_board(
+	size_t width,
+	size_t height,
+	size_t n_blocks,
+	const d3d_block_s *const blocks[])
 {
-	const d3d_block_s *block;
-	for (;;) {
-		size_t x, y;
-		d3d_direction inverted;
-		const d3d_block_s * const *blk = NULL;
-		d3d_vec_s tonext = {0, 0};
-		d3d_direction y_dir = D3D_DNEGY, x_dir = D3D_DNEGX;
-		if (dpos->x < (d3d_scalar)0.0) {
-			// The ray is going in the -x direction.
-			tonext.x = -mod1(pos->x);
-		} else if (dpos->x > (d3d_scalar)0.0) {
-			// The ray is going in the +x direction.
-			x_dir = D3D_DPOSX;
-			tonext.x = revmod1(pos->x);
-		}
-		if (dpos->y < (d3d_scalar)0.0) {
-			// The ray is going in the -y direction.
-			tonext.y = -mod1(pos->y);
-		} else if (dpos->y > (d3d_scalar)0.0) {
-			// They ray is going in the +y direction.
-			y_dir = D3D_DPOSY;
-			tonext.y = revmod1(pos->y);
-		}
-		if (dpos->x == (d3d_scalar)0.0) {
-			goto hit_y;
-		} else if (dpos->y == (d3d_scalar)0.0) {
-			goto hit_x;
-		}
-		if (tonext.x / dpos->x < tonext.y / dpos->y) {
-			// The ray will hit a wall on the x-axis first
-	hit_x:
-			*dir = x_dir;
-			pos->x += tonext.x;
-			pos->y += tonext.x / dpos->x * dpos->y;
-		} else {
-			// The ray will hit a wall on the y-axis first
-	hit_y:
-			*dir = y_dir;
-			pos->y += tonext.y;
-			pos->x += tonext.y / dpos->y * dpos->x;
-		}
-		x = tocoord(pos->x, dpos->x > (d3d_scalar)0.0);
-		y = tocoord(pos->y, dpos->y > (d3d_scalar)0.0);
-		inverted = invert_dir(*dir);
-		blk = GET(board, blocks, x, y);
-		if (!blk) return NULL; // The ray left the board
-		if ((*blk)->faces[*dir]) {
-			block = *blk;
-			*txtr = block->faces[*dir];
-			*dir = inverted;
-			return block;
-		} else {
-			// The face the ray hit is empty
-			move_dir(*dir, &x, &y);
-			blk = GET(board, blocks, x, y);
-			if (!blk) return NULL; // The ray left the board
-			if ((*blk)->faces[inverted]) {
-				block = *blk;
-				*txtr = block->faces[inverted];
-				return block;
-			} else {
-				// The face the ray hit is empty
-				// Nudge the ray past the wall:
-				if (*dir == x_dir) {
-					pos->x += copysign((d3d_scalar)0.0001,
-						dpos->x);
-				} else {
-					pos->y += copysign((d3d_scalar)0.0001,
-						dpos->y);
-				}
-			}
-		}
-		block = *blk;
-	}
+	return d3d_new_palette_board_with(width, height, n_blocks, blocks,
+		NULL);
 }
 
-static void draw_column(
-	d3d_camera *cam,
-	d3d_vec_s cam_pos,
-	d3d_scalar cam_facing,
-	const d3d_board *board,
-	size_t x)
+d3d_board *d3d_new_palette_board_with(
+	size_t width,
+	size_t height,
+	size_t n_blocks,
+	const d3d_block_s *const blocks[],
+	const d3d_allocator_s *alloc)
 {
-	d3d_direction face;
-	const d3d_block_s *block;
-	const d3d_texture *drawing;
-	d3d_vec_s pos = cam_pos, disp;
-	d3d_scalar dist;
-	d3d_scalar angle = cam_facing
-		+ cam->fov.x * ((d3d_scalar)0.5 - (d3d_scalar)x / cam->width);
-	d3d_vec_s dpos = {
-		cos(angle) * (d3d_scalar)0.001, sin(angle) * (d3d_scalar)0.001
-	};
-	block = hit_wall(board, &pos, &dpos, &face, &drawing);
-	if (!block) {
-		block = &cam->blank_block;
-		drawing = block->faces[0];
-	}
-	disp.x = pos.x - cam_pos.x;
-	disp.y = pos.y - cam_pos.y;
-	dist = hypot(disp.x, disp.y);
-	cam->dists[x] = dist;
-	// Choose how far across the wall to get pixels from based on the wall
-	// orientation, and put the distance in dimension:
-	d3d_scalar dimension;
-	switch (face) {
-	case D3D_DPOSX:
-		dimension = revmod1(pos.y);
-		break;
-	case D3D_DPOSY:
-		dimension = mod1(pos.x);
-		break;
-	case D3D_DNEGX:
-		dimension = mod1(pos.y);
-		break;
-	case D3D_DNEGY:
-	default: // The default case shouldn't be reached.
-		dimension = revmod1(pos.x);
-		break;
-	}
-	for (size_t t = 0; t < cam->height; ++t) {
-		const d3d_texture *txtr;
-		size_t tx, ty;
-		// The distance the ray travelled, assuming it hit a vertical
-		// wall:
-		d3d_scalar dist_y = cam->tans[t] * dist + (d3d_scalar)0.5;
-		if (dist_y > (d3d_scalar)0.0 && dist_y < (d3d_scalar)1.0) {
-			// A vertical wall was indeed hit
-			txtr = drawing;
-			tx = dimension * txtr->width;
-			ty = txtr->height * ((d3d_scalar)1.0 - dist_y);
-		} else {
-			// A floor or ceiling was hit instead. The horizontal
-			// displacement is adjusted accordingly:
-			d3d_scalar newdist =
-				(d3d_scalar)0.5 / fabs(cam->tans[t]);
-			d3d_vec_s newpos = {
-				cam_pos.x + disp.x / dist * newdist,
-				cam_pos.y + disp.y / dist * newdist
-			};
-			size_t bx = newpos.x, by = newpos.y;
-			const d3d_block_s *const *top_bot =
-				GET(board, blocks, bx, by);
-			if (!top_bot) goto no_texture;
-			// Ceiling hit if dist_y >= 1, floor hit if
-			// dist_y <= 0, and nothing else is possible:
-			d3d_direction face =
-				dist_y >= (d3d_scalar)1.0 ? D3D_DUP : D3D_DDOWN;
-			txtr = (*top_bot)->faces[face];
-			if (!txtr) goto no_texture;
-			tx = mod1(newpos.x) * txtr->width;
-			ty = mod1(newpos.y) * txtr->height;
-		}
-		const d3d_pixel *tpp = GET(txtr, pixels, tx, ty);
-		d3d_pixel tp;
-		if (tpp) {
-			tp = *tpp;
-		} else {
-	no_texture:
-			tp = camera_empty_pixel(cam);
-		}
-		*GET(cam, pixels, x, t) = tp;
+	size_t size, indices_offset, indices_size;
+	unsigned char index_size;
+	if (n_blocks < 1 || n_blocks > 65536) return NULL;
+	index_size = n_blocks <= 256 ? 1 : 2;
+	size = offsetof(d3d_board, blocks);
+	CHECKED_ADD(size, n_blocks * sizeof(d3d_block_s *));
+	ALIGN_SIZE(size, unsigned short);
+	indices_offset = size;
+	indices_size = width * height * index_size;
+	if (width != 0 && indices_size / index_size / width != height)
+		return NULL;
+	CHECKED_ADD(size, indices_size);
+	alloc = pick_allocator(alloc);
+	d3d_board *board = allocate(alloc, size);
+	if (!board) return NULL;
+	init_board(board, width, height, alloc);
+	board->index_size = index_size;
+	board->n_palette = n_blocks;
+	// The indices are glued on after the palette:
+	board->indices = (char *)board + indices_offset;
+	for (size_t i = 0; i < n_blocks; ++i) {
+		board->blocks[i] = blocks[i] ? blocks[i] : &empty_block;
 	}
+	memset(board->indices, 0, indices_size);
+	return board;
 }
 
-// Compare the sprite orders (see below). This is meant for qsort.
-static int compar_sprite_order(const void *a, const void *b)
+// The number of blocks in a chunk of a chunked board.
+#define CHUNK_AREA (D3D_CHUNK_SIZE * D3D_CHUNK_SIZE)
+
+// A value for an empty slot in a chunk hash table or an empty LRU link.
+#define NO_CHUNK ((size_t)-1)
+
+// Get the hash table slot where the search for a chunk should start.
+static size_t chunk_hash(const struct d3d_chunk_cache *cache, size_t cx,
+	size_t cy)
 {
-	d3d_scalar dist_a = *(d3d_scalar *)a, dist_b = *(d3d_scalar *)b;
-	if (dist_a > dist_b) return 1;
-	if (dist_a < dist_b) return -1;
-	return 0;
+	size_t h = cx * (size_t)0x9E3779B97F4A7C15ull
+		^ cy * (size_t)0xC2B2AE3D27D4EB4Full;
+	return (h ^ h >> 16) & (cache->table_cap - 1);
 }
 
-static void draw_sprite_dist(
-	d3d_camera *cam,
-	d3d_vec_s cam_pos,
-	d3d_scalar cam_facing,
-	const d3d_sprite_s *sp,
-	d3d_scalar dist)
+// Find the index in cache->entries of a loaded chunk. NO_CHUNK is returned if
+// the chunk is not loaded.
+static size_t find_chunk(const struct d3d_chunk_cache *cache, size_t cx,
+	size_t cy)
 {
-	if (sp->scale.x <= (d3d_scalar)0.0 || sp->scale.y <= (d3d_scalar)0.0)
-		return;
-	d3d_vec_s disp = { sp->pos.x - cam_pos.x, sp->pos.y - cam_pos.y };
-	d3d_scalar angle, width, height, diff, maxdiff;
+	size_t slot = chunk_hash(cache, cx, cy);
+	for (;;) {
+		size_t e = cache->table[slot];
+		if (e == NO_CHUNK) return NO_CHUNK;
+		if (cache->entries[e].cx == cx && cache->entries[e].cy == cy)
+			return e;
+		slot = (slot + 1) & (cache->table_cap - 1);
+	}
+}
+
+// Remove a chunk entry from the LRU list.
+static void unlink_chunk(struct d3d_chunk_cache *cache, size_t e)
+{
+	struct d3d_chunk_entry *ent = &cache->entries[e];
+	if (ent->prev != NO_CHUNK) {
+		cache->entries[ent->prev].next = ent->next;
+	} else {
+		cache->lru_head = ent->next;
+	}
+	if (ent->next != NO_CHUNK) {
+		cache->entries[ent->next].prev = ent->prev;
+	} else {
+		cache->lru_tail = ent->prev;
+	}
+}
+
+// Put a chunk entry at the most recently used end of the LRU list.
+static void push_chunk(struct d3d_chunk_cache *cache, size_t e)
+{
+	struct d3d_chunk_entry *ent = &cache->entries[e];
+	ent->prev = NO_CHUNK;
+	ent->next = cache->lru_head;
+	if (cache->lru_head != NO_CHUNK) {
+		cache->entries[cache->lru_head].prev = e;
+	} else {
+		cache->lru_tail = e;
+	}
+	cache->lru_head = e;
+}
+
+// Give a chunk's private blocks back to the source and release them.
+static void unload_chunk(struct d3d_chunk_cache *cache, size_t e)
+{
+	struct d3d_chunk_entry *ent = &cache->entries[e];
+	if (ent->blocks == cache->fill_chunk) return;
+	if (cache->source.unload) {
+		cache->source.unload(cache->source.ctx, ent->cx, ent->cy,
+			ent->blocks);
+	}
+	if (cache->spare) {
+		release(cache->alloc, ent->blocks);
+	} else {
+		cache->spare = ent->blocks;
+	}
+}
+
+// Evict the least recently used chunk, leaving its entry free for reuse.
+static size_t evict_chunk(struct d3d_chunk_cache *cache)
+{
+	size_t e = cache->lru_tail;
+	struct d3d_chunk_entry *ent = &cache->entries[e];
+	unload_chunk(cache, e);
+	unlink_chunk(cache, e);
+	// Remove the entry from the hash table with backward shift deletion
+	// so that no tombstones are needed:
+	size_t mask = cache->table_cap - 1;
+	size_t hole = chunk_hash(cache, ent->cx, ent->cy);
+	while (cache->table[hole] != e) hole = (hole + 1) & mask;
+	for (size_t slot = (hole + 1) & mask; cache->table[slot] != NO_CHUNK;
+	     slot = (slot + 1) & mask) {
+		struct d3d_chunk_entry *other =
+			&cache->entries[cache->table[slot]];
+		size_t home = chunk_hash(cache, other->cx, other->cy);
+		// Move the entry into the hole if its home slot is not
+		// cyclically between the hole and where it is now:
+		if (((slot - home) & mask) >= ((slot - hole) & mask)) {
+			cache->table[hole] = cache->table[slot];
+			hole = slot;
+		}
+	}
+	cache->table[hole] = NO_CHUNK;
+	cache->last = NULL;
+	--cache->n_chunks;
+	return e;
+}
+
+// Get the blocks of a chunk, loading it if it is not loaded. This never fails;
+// if memory runs out, the shared fill chunk is returned without being kept.
+static const d3d_block_s **load_chunk(struct d3d_chunk_cache *cache,
+	size_t cx, size_t cy)
+{
+	size_t e = find_chunk(cache, cx, cy);
+	if (e != NO_CHUNK) {
+		unlink_chunk(cache, e);
+		push_chunk(cache, e);
+		return cache->entries[e].blocks;
+	}
+	const d3d_block_s **blocks = cache->spare;
+	cache->spare = NULL;
+	if (!blocks) {
+		blocks = allocate(cache->alloc, CHUNK_AREA * sizeof(*blocks));
+	}
+	if (!blocks) return cache->fill_chunk;
+	memcpy(blocks, cache->fill_chunk, CHUNK_AREA * sizeof(*blocks));
+	if (!cache->source.load
+	 || !cache->source.load(cache->source.ctx, cx, cy, blocks)) {
+		// Share the fill chunk instead of keeping an identical copy:
+		cache->spare = blocks;
+		blocks = cache->fill_chunk;
+	}
+	e = cache->n_chunks < cache->max_chunks ?
+		cache->n_chunks : evict_chunk(cache);
+	++cache->n_chunks;
+	cache->entries[e].cx = cx;
+	cache->entries[e].cy = cy;
+	cache->entries[e].blocks = blocks;
+	push_chunk(cache, e);
+	size_t slot = chunk_hash(cache, cx, cy);
+	while (cache->table[slot] != NO_CHUNK)
+		slot = (slot + 1) & (cache->table_cap - 1);
+	cache->table[slot] = e;
+	return blocks;
+}
+
+// Get a pointer to the block pointer at a position on a chunked board, loading
+// the chunk if necessary. The last chunk used is remembered so that looking up
+// nearby blocks doesn't need the hash table.
+static const d3d_block_s **chunk_block(struct d3d_chunk_cache *cache,
+	size_t x, size_t y)
+{
+	size_t cx = x / D3D_CHUNK_SIZE, cy = y / D3D_CHUNK_SIZE;
+	if (!cache->last || cx != cache->last_cx || cy != cache->last_cy) {
+		cache->last = load_chunk(cache, cx, cy);
+		cache->last_cx = cx;
+		cache->last_cy = cy;
+	}
+	return &cache->last[y % D3D_CHUNK_SIZE
+		+ D3D_CHUNK_SIZE * (x % D3D_CHUNK_SIZE)];
+}
+
+d3d_board *d3d_new_chunked_board(
+	size_t width,
+	size_t height,
+	const d3d_block_s *fill,
+	const d3d_chunk_source_s *source,
+	size_t max_chunks)
+{
+	return d3d_new_chunked_board_with(width, height, fill, source,
+		max_chunks, NULL);
+}
+
+d3d_board *d3d_new_chunked_board_with(
+	size_t width,
+	size_t height,
+	const d3d_block_s *fill,
+	const d3d_chunk_source_s *source,
+	size_t max_chunks,
+	const d3d_allocator_s *alloc)
+{
+	size_t size, cache_offset, entries_offset, table_offset, fill_offset;
+	size_t table_cap = 1;
+	if (max_chunks < 1) max_chunks = 1;
+	// Keep the hash table at most half full:
+	while (table_cap / 2 < max_chunks) {
+		if (table_cap * 2 == 0) return NULL;
+		table_cap *= 2;
+	}
+	// The cache and its arrays are glued on after the board:
+	size = offsetof(d3d_board, blocks);
+	ALIGN_SIZE(size, struct d3d_chunk_cache);
+	cache_offset = size;
+	CHECKED_ADD(size, sizeof(struct d3d_chunk_cache));
+	ALIGN_SIZE(size, struct d3d_chunk_entry);
+	entries_offset = size;
+	if (max_chunks * sizeof(struct d3d_chunk_entry)
+		/ sizeof(struct d3d_chunk_entry) != max_chunks) return NULL;
+	CHECKED_ADD(size, max_chunks * sizeof(struct d3d_chunk_entry));
+	ALIGN_SIZE(size, size_t);
+	table_offset = size;
+	if (table_cap * sizeof(size_t) / sizeof(size_t) != table_cap)
+		return NULL;
+	CHECKED_ADD(size, table_cap * sizeof(size_t));
+	ALIGN_SIZE(size, d3d_block_s *);
+	fill_offset = size;
+	CHECKED_ADD(size, CHUNK_AREA * sizeof(d3d_block_s *));
+	alloc = pick_allocator(alloc);
+	d3d_board *board = allocate(alloc, size);
+	if (!board) return NULL;
+	init_board(board, width, height, alloc);
+	struct d3d_chunk_cache *cache = (void *)((char *)board + cache_offset);
+	board->chunks = cache;
+	if (source) {
+		cache->source = *source;
+	} else {
+		cache->source.load = NULL;
+		cache->source.unload = NULL;
+		cache->source.ctx = NULL;
+	}
+	cache->max_chunks = max_chunks;
+	cache->n_chunks = 0;
+	cache->entries = (void *)((char *)board + entries_offset);
+	cache->table_cap = table_cap;
+	cache->table = (void *)((char *)board + table_offset);
+	for (size_t i = 0; i < table_cap; ++i) {
+		cache->table[i] = NO_CHUNK;
+	}
+	cache->lru_head = cache->lru_tail = NO_CHUNK;
+	cache->fill_chunk = (void *)((char *)board + fill_offset);
+	if (!fill) fill = &empty_block;
+	for (size_t i = 0; i < CHUNK_AREA; ++i) {
+		cache->fill_chunk[i] = fill;
+	}
+	cache->alloc = &board->alloc;
+	cache->spare = NULL;
+	cache->last = NULL;
+	return board;
+}
+
+// Get the block at a position on the board, whatever the storage format. The
+// position must be on the board.
+static const d3d_block_s *board_block(
+	const d3d_board *board,
+	size_t x,
+	size_t y)
+{
+	if (board->chunks) return *chunk_block(board->chunks, x, y);
+	size_t i = y + board->height * x;
+	switch (board->index_size) {
+	case 0:
+		return board->blocks[i];
+	case 1:
+		return board->blocks[((const unsigned char *)board->indices)[i]];
+	default:
+		return board->blocks[((const unsigned short *)board->indices)[i]];
+	}
+}
+
+// The bits of a board's accel values. The low bits are set for the faces the
+// block has, indexed by d3d_direction. The high bits are the skip distance.
+#define ACCEL_FACES_MASK 0x3Fu
+#define ACCEL_SKIP_SHIFT 8
+#define ACCEL_FACE(dir) (1u << (dir))
+#define ACCEL_SKIP(value) ((unsigned)(value) >> ACCEL_SKIP_SHIFT)
+
+// The largest skip distance. Distances are capped at this.
+#define MAX_SKIP 255
+
+// Check whether a block has any vertical faces which could stop a ray.
+static bool block_is_wall(const d3d_block_s *block)
+{
+	return block->faces[D3D_DPOSX] || block->faces[D3D_DPOSY]
+		|| block->faces[D3D_DNEGX] || block->faces[D3D_DNEGY];
+}
+
+// Get the face bits of the accel value of a block.
+static unsigned block_face_bits(const d3d_block_s *block)
+{
+	unsigned bits = 0;
+	for (int i = 0; i < 6; ++i) {
+		if (block->faces[i]) bits |= ACCEL_FACE(i);
+	}
+	return bits;
+}
+
+// Add the D3D_DUP and D3D_DDOWN faces in the face bits to the counts of a
+// board, or subtract them if sign is -1.
+static void count_faces(d3d_board *board, unsigned bits, int sign)
+{
+	if (bits & ACCEL_FACE(D3D_DUP)) board->n_ceilings += sign;
+	if (bits & ACCEL_FACE(D3D_DDOWN)) board->n_floors += sign;
+}
+
+// Set the skip distance of an accel value, keeping the face bits.
+static void set_skip(unsigned short *value, unsigned skip)
+{
+	if (skip > MAX_SKIP) skip = MAX_SKIP;
+	*value = (*value & ACCEL_FACES_MASK) | skip << ACCEL_SKIP_SHIFT;
+}
+
+// Get a skip distance at a coordinate, treating the area outside the board as
+// walls.
+static unsigned skip_at(const d3d_board *board, size_t x, size_t y)
+{
+	const unsigned short *a = GET(board, accel, x, y);
+	return a ? ACCEL_SKIP(*a) : 0;
+}
+
+// Compute the minimum of the skip distances in the neighbourhood of a block
+// given by the offsets (dx[i], dy[i]) from it.
+static unsigned min_skip_around(
+	const d3d_board *board,
+	size_t x,
+	size_t y,
+	const int dx[],
+	const int dy[],
+	size_t n)
+{
+	unsigned min = MAX_SKIP;
+	for (size_t i = 0; i < n; ++i) {
+		unsigned s = skip_at(board, x + dx[i], y + dy[i]);
+		if (s < min) min = s;
+	}
+	return min;
+}
+
+int d3d_board_accelerate(d3d_board *board)
+{
+	// The two passes of the chamfer distance transform, each looking at
+	// the neighbours that have already been visited:
+	static const int fwd_dx[] = { -1, -1, -1,  0 };
+	static const int fwd_dy[] = { -1,  0,  1, -1 };
+	static const int bwd_dx[] = {  1,  1,  1,  0 };
+	static const int bwd_dy[] = {  1,  0, -1,  1 };
+	size_t n_blocks = board->width * board->height;
+	// A chunked board can be bigger than memory:
+	if (board->chunks) return -1;
+	if (!board->accel) {
+		// The size can't overflow as the block pointers are larger.
+		board->accel = allocate(&board->alloc,
+			(n_blocks ? n_blocks : 1) * sizeof(*board->accel));
+		if (!board->accel) return -1;
+	}
+	board->n_ceilings = 0;
+	board->n_floors = 0;
+	for (size_t x = 0; x < board->width; ++x) {
+		for (size_t y = 0; y < board->height; ++y) {
+			const d3d_block_s *block = board_block(board, x, y);
+			unsigned short *a = GET(board, accel, x, y);
+			*a = block_face_bits(block);
+			count_faces(board, *a, 1);
+			if (!block_is_wall(block)) {
+				set_skip(a, min_skip_around(board, x, y,
+					fwd_dx, fwd_dy, 4) + 1);
+			}
+		}
+	}
+	for (size_t x = board->width; x--; ) {
+		for (size_t y = board->height; y--; ) {
+			unsigned short *a = GET(board, accel, x, y);
+			unsigned s = min_skip_around(board, x, y,
+				bwd_dx, bwd_dy, 4) + 1;
+			if (s < ACCEL_SKIP(*a)) set_skip(a, s);
+		}
+	}
+	return 0;
+}
+
+void d3d_board_changed(d3d_board *board, size_t x, size_t y)
+{
+	static const int all_dx[] = { -1, -1, -1,  0,  0,  1,  1,  1 };
+	static const int all_dy[] = { -1,  0,  1, -1,  1, -1,  0,  1 };
+	if (x >= board->width || y >= board->height || !board->accel) return;
+	const d3d_block_s *block = board_block(board, x, y);
+	unsigned short *accel = GET(board, accel, x, y);
+	bool was_wall = ACCEL_SKIP(*accel) == 0;
+	count_faces(board, *accel & ACCEL_FACES_MASK, -1);
+	*accel = (*accel & ~ACCEL_FACES_MASK) | block_face_bits(block);
+	count_faces(board, *accel & ACCEL_FACES_MASK, 1);
+	if (!block_is_wall(block)) {
+		// Distances only ever grow when walls are removed, so keeping
+		// the others as they are is safe. Only the freed block is
+		// updated.
+		if (was_wall) {
+			set_skip(accel, min_skip_around(board, x, y,
+				all_dx, all_dy, 8) + 1);
+		}
+		return;
+	}
+	set_skip(accel, 0);
+	// Lower the distances in growing squares around the new wall. The
+	// distances change by at most 1 between neighbours, so once a whole
+	// ring is already low enough, so is everything beyond it.
+	for (size_t r = 1; r < MAX_SKIP; ++r) {
+		bool lowered = false;
+		for (size_t i = 0; i < 8 * r; ++i) {
+			// Walk around the ring of radius r:
+			size_t side = i / (2 * r), along = i % (2 * r);
+			size_t rx, ry;
+			switch (side) {
+			case 0: rx = x - r + along; ry = y - r; break;
+			case 1: rx = x + r; ry = y - r + along; break;
+			case 2: rx = x + r - along; ry = y + r; break;
+			default: rx = x - r; ry = y + r - along; break;
+			}
+			unsigned short *a = GET(board, accel, rx, ry);
+			if (a && ACCEL_SKIP(*a) > r) {
+				set_skip(a, r);
+				lowered = true;
+			}
+		}
+		if (!lowered) break;
+	}
+}
+
+// Check whether the block at a position on the board has the given face. The
+// position must be on the board. If the board is accelerated, the block itself
+// is never looked at.
+static bool has_face(
+	const d3d_board *board,
+	size_t x,
+	size_t y,
+	d3d_direction face)
+{
+	if (board->accel)
+		return *GET(board, accel, x, y) & ACCEL_FACE(face);
+	return board_block(board, x, y)->faces[face];
+}
+
+// Move the position pos by dpos (delta position) until a wall is hit. face is
+// set to the index of the face of the block which was hit, and the coordinates
+// of that block are put in bx and by. If no block is hit, NULL is returned and
+// face is set to the direction of the last border the ray crossed.
+// NULL is also returned once the ray has gone farther than max_dist, which may
+// be infinite.
+static const d3d_block_s *hit_wall(
+	const d3d_board *board,
+	vec_s *pos,
+	const vec_s *dpos,
+	scalar max_dist,
+	d3d_direction *face,
+	size_t *bx,
+	size_t *by)
+{
+	// The largest absolute component of dpos, used when skipping:
+	scalar dpos_max = fmax(fabs(dpos->x), fabs(dpos->y));
+	// The distance is checked along the axis of that component, which is
+	// cheaper than checking the real distance:
+	bool major_x = fabs(dpos->x) >= fabs(dpos->y);
+	scalar start = major_x ? pos->x : pos->y;
+	scalar reach = max_dist * dpos_max / hypot(dpos->x, dpos->y);
+	// The direction of the last border crossed, which is what face is set
+	// to if nothing is hit:
+	d3d_direction dir = D3D_DNEGY;
+	for (;;) {
+		size_t x, y;
+		d3d_direction inverted;
+		vec_s tonext = {0, 0};
+		d3d_direction y_dir = D3D_DNEGY, x_dir = D3D_DNEGX;
+		if (board->accel) {
+			const unsigned short *accel =
+				GET(board, accel, pos->x, pos->y);
+			unsigned skip = accel ? ACCEL_SKIP(*accel) : 0;
+			if (skip >= 3) {
+				// All blocks less than skip blocks away are
+				// empty, so jump to a point a safe margin
+				// inside that square:
+				scalar t = ((scalar)skip - (scalar)1.5)
+					/ dpos_max;
+				pos->x += dpos->x * t;
+				pos->y += dpos->y * t;
+			}
+		}
+		if (fabs((major_x ? pos->x : pos->y) - start) > reach) {
+			// The ray went too far
+			*face = dir;
+			return NULL;
+		}
+		if (dpos->x < (scalar)0.0) {
+			// The ray is going in the -x direction.
+			tonext.x = -mod1(pos->x);
+		} else if (dpos->x > (scalar)0.0) {
+			// The ray is going in the +x direction.
+			x_dir = D3D_DPOSX;
+			tonext.x = revmod1(pos->x);
+		}
+		if (dpos->y < (scalar)0.0) {
+			// The ray is going in the -y direction.
+			tonext.y = -mod1(pos->y);
+		} else if (dpos->y > (scalar)0.0) {
+			// They ray is going in the +y direction.
+			y_dir = D3D_DPOSY;
+			tonext.y = revmod1(pos->y);
+		}
+		if (dpos->x == (scalar)0.0) {
+			goto hit_y;
+		} else if (dpos->y == (scalar)0.0) {
+			goto hit_x;
+		}
+		if (tonext.x / dpos->x < tonext.y / dpos->y) {
+			// The ray will hit a wall on the x-axis first
+	hit_x:
+			dir = x_dir;
+			pos->x += tonext.x;
+			pos->y += tonext.x / dpos->x * dpos->y;
+		} else {
+			// The ray will hit a wall on the y-axis first
+	hit_y:
+			dir = y_dir;
+			pos->y += tonext.y;
+			pos->x += tonext.y / dpos->y * dpos->x;
+		}
+		x = tocoord(pos->x, dpos->x > (scalar)0.0);
+		y = tocoord(pos->y, dpos->y > (scalar)0.0);
+		inverted = invert_dir(dir);
+		if (x >= board->width || y >= board->height) {
+			// The ray left the board
+			*face = dir;
+			return NULL;
+		}
+		if (has_face(board, x, y, dir)) {
+			// The ray hit the inside of the block it was in
+			*face = dir;
+			*bx = x;
+			*by = y;
+			return board_block(board, x, y);
+		}
+		// The face the ray hit is empty
+		move_dir(dir, &x, &y);
+		if (x >= board->width || y >= board->height) {
+			// The ray left the board
+			*face = dir;
+			return NULL;
+		}
+		if (has_face(board, x, y, inverted)) {
+			// The ray hit the outside of the next block
+			*face = inverted;
+			*bx = x;
+			*by = y;
+			return board_block(board, x, y);
+		}
+		// The face the ray hit is empty
+		// Nudge the ray past the wall along its own line so that it
+		// doesn't drift over long distances:
+		scalar amount = (scalar)0.0001;
+		scalar c = dir == x_dir ? pos->x : pos->y;
+		// Far out on big boards, small nudges can be lost to rounding,
+		// especially with single precision:
+		while (c + amount == c) amount *= 2;
+		scalar nudge = amount / (dir == x_dir ?
+			fabs(dpos->x) : fabs(dpos->y));
+		pos->x += dpos->x * nudge;
+		pos->y += dpos->y * nudge;
+	}
+}
+
+// Get the step by which to move a ray in hit_wall when it is cast at angle.
+static vec_s ray_step(scalar angle)
+{
+	vec_s dpos = {
+		cos(angle) * (scalar)0.001, sin(angle) * (scalar)0.001
+	};
+	return dpos;
+}
+
+// Check whether a point is strictly inside the board, so that a ray can start
+// from it.
+static bool in_board(const d3d_board *board, vec_s pos)
+{
+	return pos.x > (scalar)0.0 && pos.y > (scalar)0.0
+		&& pos.x < board->width && pos.y < board->height;
+}
+
+// Cast a ray from origin by dpos and record the result in hit.
+static const d3d_block_s *cast_ray(
+	const d3d_board *board,
+	vec_s origin,
+	const vec_s *dpos,
+	d3d_ray_hit_s *hit)
+{
+	vec_s pos = origin;
+	hit->block = NULL;
+	if (!in_board(board, origin)) return NULL;
+	hit->block = hit_wall(board, &pos, dpos, INFINITY, &hit->face,
+		&hit->x, &hit->y);
+	if (!hit->block) return NULL;
+	hit->pos.x = pos.x;
+	hit->pos.y = pos.y;
+	hit->dist = hypot(pos.x - origin.x, pos.y - origin.y);
+	return hit->block;
+}
+
+// Check whether a wall is seen in a row of the camera screen when the wall is
+// dist away, putting in *dist_y the height up the wall where it is seen.
+static bool sees_wall(
+	const d3d_camera *cam,
+	size_t t,
+	scalar dist,
+	scalar *dist_y)
+{
+	*dist_y = cam->tans[t] * dist + (scalar)0.5;
+	return *dist_y > (scalar)0.0 && *dist_y < (scalar)1.0;
+}
+
+// Draw the rows of column x of the camera starting at row t which show a wall
+// dist away, using the texture column a fraction u of the way across the
+// texture txtr and shading with lut, which may be NULL. The index of the first
+// row after them is returned.
+static size_t draw_wall(
+	d3d_camera *cam,
+	size_t x,
+	size_t t,
+	const d3d_texture *txtr,
+	scalar u,
+	scalar dist,
+	const d3d_pixel *lut)
+{
+	d3d_pixel *out = GET(cam, pixels, x, 0);
+	size_t tx = u * txtr->width;
+	const d3d_pixel *column =
+		tx < txtr->width ? &txtr->pixels[tx * txtr->height] : NULL;
+	scalar dist_y;
+	for (; t < cam->height && sees_wall(cam, t, dist, &dist_y); ++t) {
+		size_t ty = txtr->height * ((scalar)1.0 - dist_y);
+		out[t] = column && ty < txtr->height ?
+			shade(cam, lut, column[ty]) : camera_empty_pixel(cam);
+	}
+	return t;
+}
+
+// This is like draw_wall, but only for power-of-two textures, whose texels can
+// be found with just shifts and masks.
+static size_t draw_wall_pow2(
+	d3d_camera *cam,
+	size_t x,
+	size_t t,
+	const d3d_texture *txtr,
+	scalar u,
+	scalar dist,
+	const d3d_pixel *lut)
+{
+	d3d_pixel *out = GET(cam, pixels, x, 0);
+	const d3d_pixel *column = &txtr->pixels[
+		((size_t)(u * txtr->width) & txtr->wmask) << txtr->hshift];
+	scalar dist_y;
+	for (; t < cam->height && sees_wall(cam, t, dist, &dist_y); ++t) {
+		size_t ty = txtr->height * ((scalar)1.0 - dist_y);
+		out[t] = shade(cam, lut, column[ty & txtr->hmask]);
+	}
+	return t;
+}
+
+// Draw column x of the camera. If floors or ceilings is false, the board is
+// known to have no blocks with those faces, and they are not looked for. This
+// is only called through the variants below, with constant flags.
+static ALWAYS_INLINE void draw_column(
+	d3d_camera *cam,
+	vec_s cam_pos,
+	scalar cam_facing,
+	const d3d_board *board,
+	size_t x,
+	bool floors,
+	bool ceilings)
+{
+	d3d_direction face;
+	const d3d_block_s *block;
+	const d3d_texture *drawing;
+	// The shading of the wall, if any:
+	const d3d_pixel *lut = NULL;
+	vec_s pos = cam_pos, disp;
+	scalar dist;
+	size_t bx, by;
+	scalar angle = cam_facing
+		+ cam->fov.x * ((scalar)0.5 - (scalar)x / cam->width);
+	vec_s dpos = ray_step(angle);
+	block = hit_wall(board, &pos, &dpos, cam->max_dist, &face, &bx, &by);
+	disp.x = pos.x - cam_pos.x;
+	disp.y = pos.y - cam_pos.y;
+	dist = hypot(disp.x, disp.y);
+	if (dist > cam->max_dist) {
+		// Whatever is there is hidden by fog:
+		drawing = cam->fog;
+	} else if (block) {
+		drawing = block->faces[face];
+		lut = band_lut(cam, dist);
+		// Texture orientation is based on the side the wall is seen
+		// from, which is opposite the face index:
+		face = invert_dir(face);
+	} else {
+		block = &cam->blank_block;
+		drawing = block->faces[0];
+	}
+	cam->dists[x] = dist;
+	if (drawing->mips)
+		drawing = pick_mip(drawing, lod_of(dist * cam->lod_scale));
+	// Choose how far across the wall to get pixels from based on the wall
+	// orientation, and put the distance in dimension:
+	scalar dimension;
+	switch (face) {
+	case D3D_DPOSX:
+		dimension = revmod1(pos.y);
+		break;
+	case D3D_DPOSY:
+		dimension = mod1(pos.x);
+		break;
+	case D3D_DNEGX:
+		dimension = mod1(pos.y);
+		break;
+	case D3D_DNEGY:
+	default: // The default case shouldn't be reached.
+		dimension = revmod1(pos.x);
+		break;
+	}
+	for (size_t t = 0; t < cam->height; ) {
+		const d3d_texture *txtr;
+		size_t tx, ty;
+		// The distance the ray travelled, assuming it hit a vertical
+		// wall:
+		scalar dist_y;
+		if (sees_wall(cam, t, dist, &dist_y)) {
+			// A vertical wall was indeed hit. Draw all of it at
+			// once:
+			t = drawing->pow2 ?
+				draw_wall_pow2(cam, x, t, drawing, dimension,
+					dist, lut) :
+				draw_wall(cam, x, t, drawing, dimension, dist,
+					lut);
+			continue;
+		}
+		// A floor or ceiling was hit instead. Ceiling hit if
+		// dist_y >= 1, floor hit if dist_y <= 0, and nothing else is
+		// possible:
+		bool up = dist_y >= (scalar)1.0;
+		if (fabs(cam->tans[t]) < cam->fog_tan) {
+			// The floor or ceiling is too far away:
+			*GET(cam, pixels, x, t) = cam->fog->pixels[0];
+			++t;
+			continue;
+		}
+		if (up ? !ceilings : !floors) {
+			*GET(cam, pixels, x, t) = camera_empty_pixel(cam);
+			++t;
+			continue;
+		}
+		// The horizontal displacement is adjusted accordingly:
+		scalar newdist = (scalar)0.5 / fabs(cam->tans[t]);
+		vec_s newpos = {
+			cam_pos.x + disp.x / dist * newdist,
+			cam_pos.y + disp.y / dist * newdist
+		};
+		size_t bx = newpos.x, by = newpos.y;
+		const d3d_pixel *tpp = NULL;
+		if (bx < board->width && by < board->height) {
+			txtr = board_block(board, bx, by)
+				->faces[up ? D3D_DUP : D3D_DDOWN];
+			if (txtr) {
+				if (txtr->mips) {
+					txtr = pick_mip(txtr,
+						cam->row_lods[t]);
+				}
+				tx = mod1(newpos.x) * txtr->width;
+				ty = mod1(newpos.y) * txtr->height;
+				tpp = texel(txtr, tx, ty);
+			}
+		}
+		*GET(cam, pixels, x, t) = tpp ?
+			shade(cam, cam->row_luts ? cam->row_luts[t] : NULL, *tpp) :
+			camera_empty_pixel(cam);
+		++t;
+	}
+}
+
+// Define a function drawing all the columns of a camera using draw_column with
+// constant flags.
+#define DRAW_COLUMNS_VARIANT(name, floors, ceilings) \
+static void name(d3d_camera *cam, vec_s cam_pos, scalar cam_facing, \
+	const d3d_board *board) \
+{ \
+	for (size_t x = 0; x < cam->width; ++x) { \
+		draw_column(cam, cam_pos, cam_facing, board, x, \
+			floors, ceilings); \
+	} \
+}
+
+DRAW_COLUMNS_VARIANT(draw_columns, true, true)
+DRAW_COLUMNS_VARIANT(draw_columns_floors, true, false)
+DRAW_COLUMNS_VARIANT(draw_columns_ceilings, false, true)
+DRAW_COLUMNS_VARIANT(draw_columns_walls, false, false)
+
+// Check whether any block on a board could have the given face (D3D_DUP or
+// D3D_DDOWN.) When this is not known cheaply, true is returned.
+static bool board_may_have(const d3d_board *board, d3d_direction face)
+{
+	if (board->accel)
+		return (face == D3D_DUP ? board->n_ceilings : board->n_floors);
+	if (board->index_size != 0 && board->n_palette <= 256) {
+		for (size_t i = 0; i < board->n_palette; ++i) {
+			if (board->blocks[i]->faces[face]) return true;
+		}
+		return false;
+	}
+	return true;
+}
+
+// Compare the sprite orders (see below). This is meant for qsort.
+static int compar_sprite_order(const void *a, const void *b)
+{
+	scalar dist_a = *(scalar *)a, dist_b = *(scalar *)b;
+	if (dist_a > dist_b) return 1;
+	if (dist_a < dist_b) return -1;
+	return 0;
+}
+
+// Draw a sprite dist away. If keyed is false, the sprite has no transparent
+// pixel and none of its pixels are checked. This is only called through the
+// variants below, with a constant flag. Whether the sprite was in the field of
+// view is returned.
+static ALWAYS_INLINE bool draw_sprite_dist(
+	d3d_camera *cam,
+	vec_s cam_pos,
+	scalar cam_facing,
+	const d3d_sprite_s *sp,
+	scalar dist,
+	bool keyed)
+{
+	const d3d_texture *txtr = sp->txtr;
+	vec_s pos = to_vec(sp->pos), scale = to_vec(sp->scale);
+	const d3d_pixel *lut = band_lut(cam, dist);
+	if (scale.x <= (scalar)0.0 || scale.y <= (scalar)0.0) return false;
+	vec_s disp = { pos.x - cam_pos.x, pos.y - cam_pos.y };
+	scalar angle, width, height, diff, maxdiff;
 	long start_x, start_y;
-	if (dist == (d3d_scalar)0.0) return;
+	if (dist == (scalar)0.0) return false;
 	// The angle of the sprite relative to the +x axis:
 	angle = atan2(disp.y, disp.x);
 	// The view width of the sprite in radians:
-	width = atan(sp->scale.x / dist) * 2;
+	width = atan(scale.x / dist) * 2;
 	// The max camera-sprite angle difference so the sprite's visible:
 	maxdiff = (cam->fov.x + width) / 2;
 	diff = angle_diff(cam_facing, angle);
-	if (fabs(diff) > maxdiff) return;
+	if (fabs(diff) > maxdiff) return false;
 	// The height of the sprite in pixels on the camera screen:
-	height = atan(sp->scale.y / dist) * 2 / cam->fov.y * cam->height;
+	height = atan(scale.y / dist) * 2 / cam->fov.y * cam->height;
 	// The width of the sprite in pixels on the camera screen:
 	width = width / cam->fov.x * cam->width;
 	// The first x where the sprite appears on the screen:
@@ -473,83 +1724,1804 @@ static void draw_sprite_dist(
 		size_t cx, sx;
 		cx = x + start_x;
 		if (cx >= cam->width || dist >= cam->dists[cx]) continue;
-		sx = (d3d_scalar)x / width * sp->txtr->width;
-		if (sx >= sp->txtr->width) continue;
+		sx = (scalar)x / width * txtr->width;
+		if (sx >= txtr->width) continue;
+		d3d_pixel *out = GET(cam, pixels, cx, 0);
+		if (txtr->pow2) {
+			// Power-of-two textures need only shifts and masks:
+			const d3d_pixel *column =
+				&txtr->pixels[sx << txtr->hshift];
+			for (size_t y = 0; y < height; ++y) {
+				size_t cy = y + start_y, sy;
+				if (cy >= cam->height) continue;
+				sy = (size_t)((scalar)y / height
+					* txtr->height) & txtr->hmask;
+				d3d_pixel p = column[sy];
+				if (!keyed || p != sp->transparent)
+					out[cy] = shade(cam, lut, p);
+			}
+			continue;
+		}
+		const d3d_pixel *column = &txtr->pixels[sx * txtr->height];
 		for (size_t y = 0; y < height; ++y) {
 			// cy and sy correspond to cx and sx above:
 			size_t cy, sy;
 			cy = y + start_y;
 			if (cy >= cam->height) continue;
-			sy = (d3d_scalar)y / height * sp->txtr->height;
-			if (sy >= sp->txtr->height) continue;
-			d3d_pixel p = *GET(sp->txtr, pixels, sx, sy);
-			if (p != sp->transparent) *GET(cam, pixels, cx, cy) = p;
+			sy = (scalar)y / height * txtr->height;
+			if (sy >= txtr->height) continue;
+			d3d_pixel p = column[sy];
+			if (!keyed || p != sp->transparent)
+				out[cy] = shade(cam, lut, p);
+		}
+	}
+	return true;
+}
+
+// Define a function drawing a sprite using draw_sprite_dist with a constant
+// flag.
+#define DRAW_SPRITE_VARIANT(name, keyed) \
+static bool name(d3d_camera *cam, vec_s cam_pos, scalar cam_facing, \
+	const d3d_sprite_s *sp, scalar dist) \
+{ \
+	return draw_sprite_dist(cam, cam_pos, cam_facing, sp, dist, keyed); \
+}
+
+DRAW_SPRITE_VARIANT(draw_sprite_keyed, true)
+DRAW_SPRITE_VARIANT(draw_sprite_opaque, false)
+
+// Get the key by which a sprite dist away is sorted. Sprites beyond the view
+// distance all get the same infinite key, so that sorting leaves them be.
+static scalar sprite_key(const d3d_camera *cam, scalar dist)
+{
+	return dist > cam->max_dist ? INFINITY : dist;
+}
+
+// Check whether the block at index i in the layout of board blocks is in the
+// given runs of a PVS.
+static bool pvs_runs_have(const uint32_t *runs, size_t n_runs, size_t i)
+{
+	// Find the last run starting at or before i:
+	size_t lo = 0, hi = n_runs;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (runs[2 * mid] <= i) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo > 0 && i < runs[2 * (lo - 1) + 1];
+}
+
+// The most cells a sprite can cover before it is assumed to be seen without
+// checking them all.
+#define PVS_MAX_SPRITE_CELLS 64
+
+// Check whether any cell a sprite could cover is in the given runs of a PVS.
+// The sprite must be inside the board to be seen.
+static bool pvs_sees_sprite(
+	const d3d_board *board,
+	const uint32_t *runs,
+	size_t n_runs,
+	const d3d_sprite_s *sp)
+{
+	vec_s pos = to_vec(sp->pos);
+	if (!in_board(board, pos)) return false;
+	// The sprite turns to face the camera, so it can reach its x scale away
+	// in any direction (see draw_sprite_dist):
+	scalar half = fabs((scalar)sp->scale.x);
+	size_t x0 = fmax(pos.x - half, (scalar)0.0);
+	size_t y0 = fmax(pos.y - half, (scalar)0.0);
+	size_t x1 = fmin(pos.x + half, (scalar)(board->width - 1));
+	size_t y1 = fmin(pos.y + half, (scalar)(board->height - 1));
+	if ((x1 - x0 + 1) * (y1 - y0 + 1) > PVS_MAX_SPRITE_CELLS) return true;
+	for (size_t x = x0; x <= x1; ++x) {
+		for (size_t y = y0; y <= y1; ++y) {
+			if (pvs_runs_have(runs, n_runs, y + board->height * x))
+				return true;
+		}
+	}
+	return false;
+}
+
+// The PVS of the cell of the camera, if the board has PVSs. The camera must be
+// on the board.
+struct pvs_view {
+	const uint32_t *runs;
+	size_t n_runs;
+};
+
+static struct pvs_view pvs_view_of(const d3d_board *board, vec_s cam_pos)
+{
+	struct pvs_view view = { NULL, 0 };
+	if (board->pvs) {
+		size_t cell = (size_t)cam_pos.y
+			+ board->height * (size_t)cam_pos.x;
+		view.runs = board->pvs_runs + 2 * board->pvs[cell];
+		view.n_runs = board->pvs[cell + 1] - board->pvs[cell];
+	}
+	return view;
+}
+
+// Get the key by which a sprite is sorted, which is infinite if the sprite is
+// culled by the PVS or the view distance.
+static scalar sprite_sort_key(
+	const d3d_camera *cam,
+	vec_s cam_pos,
+	const d3d_board *board,
+	const struct pvs_view *view,
+	const d3d_sprite_s *sp)
+{
+	if (view->runs && !pvs_sees_sprite(board, view->runs, view->n_runs, sp))
+		return INFINITY;
+	vec_s pos = to_vec(sp->pos);
+	return sprite_key(cam, hypot(pos.x - cam_pos.x, pos.y - cam_pos.y));
+}
+
+// Draw the sprites in the first n entries of cam->order, back to front. The
+// sprite of an entry is at base + index * stride.
+static void draw_sorted_sprites(
+	d3d_camera *cam,
+	vec_s cam_pos,
+	scalar cam_facing,
+	size_t n,
+	const char *base,
+	size_t stride)
+{
+	size_t i = n;
+	while (i--) {
+		struct d3d_sprite_order *ord = &cam->order[i];
+		if (ord->dist == INFINITY) continue;
+		const d3d_sprite_s *sp =
+			(const d3d_sprite_s *)(base + ord->index * stride);
+		bool seen;
+		if (sp->transparent == (d3d_pixel)-1) {
+			seen = draw_sprite_opaque(cam, cam_pos, cam_facing, sp,
+				ord->dist);
+		} else {
+			seen = draw_sprite_keyed(cam, cam_pos, cam_facing, sp,
+				ord->dist);
+		}
+		cam->n_sprites_drawn += seen;
+	}
+}
+
+static void draw_sprites(
+	d3d_camera *cam,
+	vec_s cam_pos,
+	scalar cam_facing,
+	const d3d_board *board,
+	size_t n_sprites,
+	const d3d_sprite_s sprites[])
+{
+	size_t i;
+	struct pvs_view view = pvs_view_of(board, cam_pos);
+	if (n_sprites == cam->last_n_sprites && sprites == cam->last_sprites) {
+		// This assumes the sprites didn't move much, and are mostly
+		// sorted. Therefore, insertion sort is used.
+		for (i = 0; i < n_sprites; ++i) {
+			size_t move_to;
+			struct d3d_sprite_order ord = cam->order[i];
+			ord.dist = sprite_sort_key(cam, cam_pos, board, &view,
+				&sprites[ord.index]);
+			move_to = i;
+			for (long j = (long)i - 1; j >= 0; --j) {
+				if (cam->order[j].dist <= ord.dist) break;
+				move_to = j;
+			}
+			memmove(cam->order + move_to + 1, cam->order + move_to,
+				(i - move_to) * sizeof(*cam->order));
+			cam->order[move_to] = ord;
+	       }
+	} else {
+		if (n_sprites > cam->order_buf_cap) {
+			struct d3d_sprite_order *new_order;
+			size_t size = n_sprites * sizeof(*cam->order);
+			if (size / sizeof(*cam->order) == n_sprites
+			 && (new_order = cam->alloc.resize(cam->alloc.ctx,
+				cam->order,
+				cam->order_buf_cap * sizeof(*cam->order),
+				size))) {
+				cam->order = new_order;
+				cam->order_buf_cap = n_sprites;
+			} else {
+				// XXX Silently truncate the list of sprites
+				// drawn. This may be a bad decision, but
+				// failure is unlikely and this shouldn't break
+				// any client code.
+				n_sprites = cam->order_buf_cap;
+			}
+		}
+		// Sprites in view are put at the front to be sorted. The ones
+		// out of view go at the back and are left in any order:
+		size_t front = 0, back = n_sprites;
+		for (i = 0; i < n_sprites; ++i) {
+			scalar key = sprite_sort_key(cam, cam_pos, board,
+				&view, &sprites[i]);
+			struct d3d_sprite_order *ord = key == INFINITY ?
+				&cam->order[--back] : &cam->order[front++];
+			ord->dist = key;
+			ord->index = i;
+		}
+		qsort(cam->order, front, sizeof(*cam->order),
+			compar_sprite_order);
+		cam->last_sprites = sprites;
+		cam->last_n_sprites = n_sprites;
+		cam->last_index = NULL;
+	}
+	draw_sorted_sprites(cam, cam_pos, cam_facing, n_sprites,
+		(const char *)sprites, sizeof(*sprites));
+}
+
+// Draw the board without sprites. The canonical camera direction is put in
+// *cam_facing. If the camera is off the board, the screen is emptied and false
+// is returned.
+static bool draw_board(
+	d3d_camera *cam,
+	vec_s cam_pos,
+	d3d_scalar camera_facing,
+	scalar *cam_facing,
+	const d3d_board *board)
+{
+	cam->n_sprites_drawn = 0;
+	if (!in_board(board, cam_pos)) {
+		empty_camera_pixels(cam);
+		return false;
+	}
+	// Canonicalize camera direction:
+	camera_facing = fmod(camera_facing, 2 * (d3d_scalar)PI);
+	if (camera_facing < (d3d_scalar)0.0)
+		camera_facing += 2 * (d3d_scalar)PI;
+	*cam_facing = camera_facing;
+	// Pick the column drawer which skips what the board lacks:
+	bool floors = board_may_have(board, D3D_DDOWN);
+	bool ceilings = board_may_have(board, D3D_DUP);
+	if (floors && ceilings) {
+		draw_columns(cam, cam_pos, *cam_facing, board);
+	} else if (floors) {
+		draw_columns_floors(cam, cam_pos, *cam_facing, board);
+	} else if (ceilings) {
+		draw_columns_ceilings(cam, cam_pos, *cam_facing, board);
+	} else {
+		draw_columns_walls(cam, cam_pos, *cam_facing, board);
+	}
+	return true;
+}
+
+void d3d_draw(
+	d3d_camera *cam,
+	d3d_vec_s camera_pos,
+	d3d_scalar camera_facing,
+	const d3d_board *board,
+	size_t n_sprites,
+	const d3d_sprite_s sprites[])
+{
+	vec_s cam_pos = to_vec(camera_pos);
+	scalar cam_facing;
+	if (draw_board(cam, cam_pos, camera_facing, &cam_facing, board)
+	 && n_sprites > 0) {
+		draw_sprites(cam, cam_pos, cam_facing, board, n_sprites,
+			sprites);
+	}
+}
+
+// Check whether a sprite dist away could be drawn by draw_sprite_dist, which
+// uses the same test.
+static bool sprite_in_view(
+	const d3d_camera *cam,
+	vec_s cam_pos,
+	scalar cam_facing,
+	const d3d_sprite_s *sp,
+	scalar dist)
+{
+	vec_s pos = to_vec(sp->pos), scale = to_vec(sp->scale);
+	if (scale.x <= (scalar)0.0 || scale.y <= (scalar)0.0
+	 || dist == (scalar)0.0) return false;
+	scalar angle = atan2(pos.y - cam_pos.y, pos.x - cam_pos.x);
+	scalar width = atan(scale.x / dist) * 2;
+	scalar maxdiff = (cam->fov.x + width) / 2;
+	return fabs(angle_diff(cam_facing, angle)) <= maxdiff;
+}
+
+// Check whether a bucket of an index could hold a sprite which is seen.
+static bool bucket_in_view(
+	const d3d_camera *cam,
+	vec_s cam_pos,
+	scalar cam_facing,
+	const d3d_sprite_index *index,
+	size_t bx,
+	size_t by)
+{
+	scalar x0 = (scalar)(bx * index->bucket_size);
+	scalar y0 = (scalar)(by * index->bucket_size);
+	scalar x1 = fmin(x0 + index->bucket_size, (scalar)index->width);
+	scalar y1 = fmin(y0 + index->bucket_size, (scalar)index->height);
+	// The centers of the sprites are within the bucket:
+	scalar dx = fmax(fmax(x0 - cam_pos.x, cam_pos.x - x1), (scalar)0.0);
+	scalar dy = fmax(fmax(y0 - cam_pos.y, cam_pos.y - y1), (scalar)0.0);
+	if (hypot(dx, dy) > cam->max_dist) return false;
+	// Their images are within the bucket grown by the reach:
+	scalar reach = index->reach;
+	x0 -= reach;
+	y0 -= reach;
+	x1 += reach;
+	y1 += reach;
+	if (cam_pos.x >= x0 && cam_pos.x <= x1
+	 && cam_pos.y >= y0 && cam_pos.y <= y1) return true;
+	// A bit is added so rounding never hides anything:
+	scalar half_fov = cam->fov.x / 2 + (scalar)0.01;
+	if (half_fov >= PI) return true;
+	// The camera is outside the grown bucket, so the angles of its corners
+	// from the camera span less than half a turn around its center:
+	scalar center = atan2((y0 + y1) / 2 - cam_pos.y,
+		(x0 + x1) / 2 - cam_pos.x);
+	scalar lo = 0, hi = 0;
+	for (int c = 0; c < 4; ++c) {
+		scalar corner = atan2((c & 1 ? y1 : y0) - cam_pos.y,
+			(c & 2 ? x1 : x0) - cam_pos.x);
+		scalar diff = angle_diff(corner, center);
+		lo = fmin(lo, diff);
+		hi = fmax(hi, diff);
+	}
+	// Relative to the camera direction, the bucket spans off + lo to
+	// off + hi, which may wrap around:
+	scalar off = angle_diff(center, cam_facing);
+	for (int turn = -1; turn <= 1; ++turn) {
+		scalar shift = off + turn * 2 * (scalar)PI;
+		if (shift + lo <= half_fov && shift + hi >= -half_fov)
+			return true;
+	}
+	return false;
+}
+
+// The result of a failed index operation or a missing bucket link.
+#define NO_ID ((size_t)-1)
+
+// Look at a sprite while drawing an index. If it is seen, it is put at
+// cam->order[at] and true is returned.
+static bool visit_indexed(
+	d3d_camera *cam,
+	vec_s cam_pos,
+	scalar cam_facing,
+	const d3d_board *board,
+	const struct pvs_view *view,
+	d3d_sprite_index *index,
+	size_t id,
+	size_t at)
+{
+	struct d3d_sprite_index_entry *ent = &index->entries[id];
+	ent->stamp = index->stamp;
+	scalar key = sprite_sort_key(cam, cam_pos, board, view, &ent->sprite);
+	if (key == INFINITY
+	 || !sprite_in_view(cam, cam_pos, cam_facing, &ent->sprite, key))
+		return false;
+	cam->order[at].dist = key;
+	cam->order[at].index = id;
+	return true;
+}
+
+void d3d_draw_indexed(
+	d3d_camera *cam,
+	d3d_vec_s camera_pos,
+	d3d_scalar camera_facing,
+	const d3d_board *board,
+	d3d_sprite_index *index)
+{
+	vec_s cam_pos = to_vec(camera_pos);
+	scalar cam_facing;
+	if (!draw_board(cam, cam_pos, camera_facing, &cam_facing, board))
+		return;
+	if (++index->stamp == 0) {
+		// The stamps wrapped around, so old ones might look new:
+		for (size_t i = 0; i < index->n_entries; ++i) {
+			index->entries[i].stamp = 0;
+		}
+		index->stamp = 1;
+	}
+	// The sprites seen are sorted at the front of the order buffer. Those
+	// newly seen are sorted in the back half before being merged in:
+	size_t n = index->n_sprites;
+	if (n <= SIZE_MAX / 2 / sizeof(*cam->order)
+	 && 2 * n > cam->order_buf_cap) {
+		struct d3d_sprite_order *new_order = cam->alloc.resize(
+			cam->alloc.ctx, cam->order,
+			cam->order_buf_cap * sizeof(*cam->order),
+			2 * n * sizeof(*cam->order));
+		// XXX As with d3d_draw, sprites are silently dropped if this
+		// fails.
+		if (new_order) {
+			cam->order = new_order;
+			cam->order_buf_cap = 2 * n;
+		}
+	}
+	size_t limit = cam->order_buf_cap / 2;
+	struct d3d_sprite_order *fresh = cam->order + limit;
+	struct pvs_view view = pvs_view_of(board, cam_pos);
+	size_t n_kept = 0, n_fresh = 0;
+	if (cam->last_index == index) {
+		// The sprites seen last time are likely still seen and mostly
+		// sorted, so insertion sort is used on them:
+		for (size_t i = 0; i < cam->last_n_sprites; ++i) {
+			size_t id = cam->order[i].index;
+			if (id >= index->n_entries
+			 || index->entries[id].bucket >= D3D_INDEX_OUTSIDE
+			 || index->entries[id].stamp == index->stamp
+			 || !visit_indexed(cam, cam_pos, cam_facing, board,
+				&view, index, id, n_kept)) continue;
+			struct d3d_sprite_order ord = cam->order[n_kept];
+			size_t move_to = n_kept;
+			while (move_to > 0
+			    && cam->order[move_to - 1].dist > ord.dist) {
+				--move_to;
+			}
+			memmove(cam->order + move_to + 1, cam->order + move_to,
+				(n_kept - move_to) * sizeof(*cam->order));
+			cam->order[move_to] = ord;
+			++n_kept;
+		}
+	}
+	// Only buckets within the view distance are gone through:
+	size_t bx0 = 0, by0 = 0;
+	size_t bx1 = index->buckets_x, by1 = index->buckets_y;
+	if (cam->max_dist < INFINITY) {
+		scalar size = index->bucket_size;
+		scalar d = cam->max_dist;
+		bx0 = fmax((cam_pos.x - d) / size, (scalar)0.0);
+		by0 = fmax((cam_pos.y - d) / size, (scalar)0.0);
+		bx1 = fmin((cam_pos.x + d) / size + 1, (scalar)bx1);
+		by1 = fmin((cam_pos.y + d) / size + 1, (scalar)by1);
+	}
+	for (size_t bx = bx0; bx < bx1; ++bx) {
+		for (size_t by = by0; by < by1; ++by) {
+			if (!bucket_in_view(cam, cam_pos, cam_facing, index,
+				bx, by)) continue;
+			size_t id = index->heads[by + index->buckets_y * bx];
+			for (; id != NO_ID; id = index->entries[id].next) {
+				if (index->entries[id].stamp == index->stamp
+				 || n_kept + n_fresh >= limit) continue;
+				if (visit_indexed(cam, cam_pos, cam_facing,
+					board, &view, index, id,
+					limit + n_fresh)) ++n_fresh;
+			}
+		}
+	}
+	qsort(fresh, n_fresh, sizeof(*fresh), compar_sprite_order);
+	// Merge from the back, where nothing is left to read:
+	size_t i = n_kept, j = n_fresh, to = n_kept + n_fresh;
+	while (j > 0) {
+		if (i > 0 && cam->order[i - 1].dist > fresh[j - 1].dist) {
+			cam->order[--to] = cam->order[--i];
+		} else {
+			cam->order[--to] = fresh[--j];
+		}
+	}
+	cam->last_sprites = NULL;
+	cam->last_n_sprites = n_kept + n_fresh;
+	cam->last_index = index;
+	// The sprite is the first member of an entry:
+	draw_sorted_sprites(cam, cam_pos, cam_facing, cam->last_n_sprites,
+		(const char *)index->entries, sizeof(*index->entries));
+}
+
+size_t d3d_render_batch(
+	d3d_camera *cam,
+	const d3d_board *board,
+	size_t n_poses,
+	const d3d_pose_s poses[],
+	size_t first,
+	size_t step,
+	int (*emit)(void *ctx, size_t index, d3d_camera *cam),
+	void *ctx)
+{
+	size_t n_drawn = 0;
+	if (step == 0) step = 1;
+	for (size_t i = first; i < n_poses; i += step) {
+		d3d_draw(cam, poses[i].pos, poses[i].facing, board, 0, NULL);
+		++n_drawn;
+		if (emit(ctx, i, cam)) break;
+		// Avoid wrapping around past the end:
+		if (n_poses - i <= step) break;
+	}
+	return n_drawn;
+}
+
+const d3d_block_s *d3d_cast_ray(
+	const d3d_board *board,
+	d3d_vec_s origin,
+	d3d_scalar angle,
+	d3d_ray_hit_s *hit)
+{
+	vec_s dpos = ray_step(angle);
+	return cast_ray(board, to_vec(origin), &dpos, hit);
+}
+
+void d3d_cast_rays(
+	const d3d_board *board,
+	size_t n_rays,
+	const d3d_vec_s origins[],
+	const d3d_scalar angles[],
+	d3d_ray_hit_s hits[])
+{
+	// Ray steps are computed in batches first so that the trigonometry can
+	// be vectorized apart from the branchy traversal.
+	enum { BATCH = 64 };
+	vec_s steps[BATCH];
+	for (size_t i = 0; i < n_rays; i += BATCH) {
+		size_t n = n_rays - i < BATCH ? n_rays - i : BATCH;
+		for (size_t j = 0; j < n; ++j) {
+			steps[j] = ray_step(angles[i + j]);
+		}
+		for (size_t j = 0; j < n; ++j) {
+			cast_ray(board, to_vec(origins[i + j]), &steps[j],
+				&hits[i + j]);
+		}
+	}
+}
+
+// The number of points along each side of a cell from which rays are cast when
+// computing its PVS. The outer points are PVS_INSET from the sides.
+#define PVS_ORIGINS 3
+#define PVS_INSET ((scalar)0.001)
+
+// Scratch space for computing a PVS: a mark for each cell of the board and a
+// list of the indices of the marked cells.
+struct pvs_scratch {
+	unsigned char *marks;
+	uint32_t *marked;
+	size_t n_marked;
+};
+
+// Mark a cell as visible if it is on the board.
+static void pvs_mark(
+	struct pvs_scratch *scratch,
+	const d3d_board *board,
+	long x,
+	long y)
+{
+	if (x < 0 || y < 0 || (size_t)x >= board->width
+	 || (size_t)y >= board->height) return;
+	size_t i = (size_t)y + board->height * (size_t)x;
+	if (scratch->marks[i]) return;
+	scratch->marks[i] = 1;
+	scratch->marked[scratch->n_marked++] = i;
+}
+
+// Mark the cells crossed by the line segment from a to b as visible. b is where
+// a ray stopped, so it is pulled back a bit to leave out the cell beyond it,
+// which is only marked if the ray hit a wall there.
+static void pvs_mark_segment(
+	struct pvs_scratch *scratch,
+	const d3d_board *board,
+	vec_s a,
+	vec_s b)
+{
+	vec_s d = { b.x - a.x, b.y - a.y };
+	scalar len = hypot(d.x, d.y);
+	if (len > (scalar)0.001) {
+		b.x -= d.x / len * (scalar)0.001;
+		b.y -= d.y / len * (scalar)0.001;
+	} else {
+		b = a;
+	}
+	long x = floor(a.x), y = floor(a.y);
+	long end_x = floor(b.x), end_y = floor(b.y);
+	long step_x = end_x > x ? 1 : -1, step_y = end_y > y ? 1 : -1;
+	// How far along the segment the next x and y borders are, and how far
+	// apart the borders are along it:
+	scalar next_x = d.x > (scalar)0.0 ? (x + 1 - a.x) / d.x
+		: d.x < (scalar)0.0 ? (a.x - x) / -d.x : INFINITY;
+	scalar next_y = d.y > (scalar)0.0 ? (y + 1 - a.y) / d.y
+		: d.y < (scalar)0.0 ? (a.y - y) / -d.y : INFINITY;
+	scalar delta_x = d.x != (scalar)0.0 ? fabs(1 / d.x) : INFINITY;
+	scalar delta_y = d.y != (scalar)0.0 ? fabs(1 / d.y) : INFINITY;
+	pvs_mark(scratch, board, x, y);
+	while (x != end_x || y != end_y) {
+		if (y == end_y || (x != end_x && next_x < next_y)) {
+			x += step_x;
+			next_x += delta_x;
+		} else {
+			y += step_y;
+			next_y += delta_y;
+		}
+		pvs_mark(scratch, board, x, y);
+	}
+}
+
+// Compare indices of cells. This is meant for qsort.
+static int compar_cell(const void *a, const void *b)
+{
+	uint32_t cell_a = *(const uint32_t *)a, cell_b = *(const uint32_t *)b;
+	if (cell_a > cell_b) return 1;
+	if (cell_a < cell_b) return -1;
+	return 0;
+}
+
+// Compute the PVS of a cell, adding its runs to the end of those of pvs. false
+// is returned if allocation fails.
+static bool pvs_cell(
+	d3d_pvs *pvs,
+	const d3d_board *board,
+	struct pvs_scratch *scratch,
+	size_t n_rays,
+	const vec_s steps[],
+	size_t x,
+	size_t y)
+{
+	scratch->n_marked = 0;
+	pvs_mark(scratch, board, x, y);
+	for (int ox = 0; ox < PVS_ORIGINS; ++ox) {
+		for (int oy = 0; oy < PVS_ORIGINS; ++oy) {
+			// The camera can be anywhere in the cell, so the
+			// points go all the way to the sides:
+			scalar spread = (1 - 2 * PVS_INSET) / (PVS_ORIGINS - 1);
+			vec_s origin = {
+				x + PVS_INSET + ox * spread,
+				y + PVS_INSET + oy * spread
+			};
+			for (size_t r = 0; r < n_rays; ++r) {
+				vec_s pos = origin;
+				d3d_direction face;
+				size_t bx, by;
+				// The block hit is seen, and sprites can stand
+				// partly inside it:
+				if (hit_wall(board, &pos, &steps[r], INFINITY,
+					&face, &bx, &by))
+					pvs_mark(scratch, board, bx, by);
+				pvs_mark_segment(scratch, board, origin, pos);
+			}
+		}
+	}
+	// Turn the marked cells into runs, clearing the marks on the way:
+	qsort(scratch->marked, scratch->n_marked, sizeof(*scratch->marked),
+		compar_cell);
+	size_t first_run = pvs->n_runs;
+	for (size_t i = 0; i < scratch->n_marked; ++i) {
+		uint32_t cell = scratch->marked[i];
+		scratch->marks[cell] = 0;
+		if (pvs->n_runs > first_run
+		 && pvs->runs[2 * pvs->n_runs - 1] == cell) {
+			++pvs->runs[2 * pvs->n_runs - 1];
+			continue;
+		}
+		if (pvs->n_runs >= pvs->runs_cap) {
+			size_t new_cap = pvs->runs_cap * 2;
+			if (new_cap > UINT32_MAX
+			 || new_cap > SIZE_MAX / 2 / sizeof(*pvs->runs))
+				return false;
+			uint32_t *runs = pvs->alloc.resize(pvs->alloc.ctx,
+				pvs->runs, pvs->runs_cap * 2 * sizeof(*runs),
+				new_cap * 2 * sizeof(*runs));
+			if (!runs) return false;
+			pvs->runs = runs;
+			pvs->runs_cap = new_cap;
+		}
+		pvs->runs[2 * pvs->n_runs] = cell;
+		pvs->runs[2 * pvs->n_runs + 1] = cell + 1;
+		++pvs->n_runs;
+	}
+	return true;
+}
+
+d3d_pvs *d3d_new_pvs(
+	const d3d_board *board,
+	size_t n_rays,
+	size_t first,
+	size_t step)
+{
+	return d3d_new_pvs_with(board, n_rays, first, step, NULL);
+}
+
+d3d_pvs *d3d_new_pvs_with(
+	const d3d_board *board,
+	size_t n_rays,
+	size_t first,
+	size_t step,
+	const d3d_allocator_s *alloc)
+{
+	size_t width = board->width, height = board->height;
+	if (board->chunks || (width > 0 && height > UINT32_MAX / width))
+		return NULL;
+	size_t n_cells = width * height;
+	// There is an offset per cell and one more, and as many marked cells:
+	if (n_cells >= SIZE_MAX / sizeof(uint32_t)) return NULL;
+	if (step == 0) step = 1;
+	size_t n_columns = first < width ? (width - first - 1) / step + 1 : 0;
+	// The PVSs and offsets are allocated together:
+	size_t size = sizeof(d3d_pvs);
+	ALIGN_SIZE(size, uint32_t);
+	size_t offsets_offset = size;
+	CHECKED_ADD(size, (n_columns * height + 1) * sizeof(uint32_t));
+	// So are the scratch space and ray steps, separately:
+	size_t scratch_size = n_cells, steps_offset, marked_offset;
+	ALIGN_SIZE(scratch_size, vec_s);
+	steps_offset = scratch_size;
+	if (n_rays > SIZE_MAX / sizeof(vec_s)) return NULL;
+	CHECKED_ADD(scratch_size, n_rays * sizeof(vec_s));
+	ALIGN_SIZE(scratch_size, uint32_t);
+	marked_offset = scratch_size;
+	CHECKED_ADD(scratch_size, n_cells * sizeof(uint32_t));
+	alloc = pick_allocator(alloc);
+	d3d_pvs *pvs = allocate(alloc, size);
+	if (!pvs) return NULL;
+	pvs->alloc = *alloc;
+	pvs->width = width;
+	pvs->height = height;
+	pvs->first = first;
+	pvs->step = step;
+	pvs->n_runs = 0;
+	pvs->runs_cap = 16;
+	pvs->offsets = (void *)((char *)pvs + offsets_offset);
+	pvs->runs = allocate(alloc, pvs->runs_cap * 2 * sizeof(*pvs->runs));
+	struct pvs_scratch scratch;
+	scratch.marks = pvs->runs ? allocate(alloc, scratch_size) : NULL;
+	if (!scratch.marks) goto error;
+	memset(scratch.marks, 0, n_cells);
+	vec_s *steps = (void *)(scratch.marks + steps_offset);
+	scratch.marked = (void *)(scratch.marks + marked_offset);
+	for (size_t r = 0; r < n_rays; ++r) {
+		steps[r] = ray_step(2 * (scalar)PI * (r + (scalar)0.5)
+			/ n_rays);
+	}
+	size_t k = 0;
+	for (size_t x = first; x < width; x += step) {
+		for (size_t y = 0; y < height; ++y) {
+			pvs->offsets[k++] = pvs->n_runs;
+			if (!pvs_cell(pvs, board, &scratch, n_rays, steps, x,
+					y)) {
+				release(alloc, scratch.marks);
+				goto error;
+			}
+		}
+		if (width - x <= step) break;
+	}
+	pvs->offsets[k] = pvs->n_runs;
+	release(alloc, scratch.marks);
+	return pvs;
+
+error:
+	d3d_free_pvs(pvs);
+	return NULL;
+}
+
+// Find the part covering a board column, putting in k which column of the part
+// it is. NULL is returned if no part covers it.
+static const d3d_pvs *pvs_part(
+	size_t n_parts,
+	const d3d_pvs *const parts[],
+	size_t x,
+	size_t *k)
+{
+	for (size_t p = 0; p < n_parts; ++p) {
+		if (x >= parts[p]->first && (x - parts[p]->first)
+			% parts[p]->step == 0) {
+			*k = (x - parts[p]->first) / parts[p]->step;
+			return parts[p];
+		}
+	}
+	return NULL;
+}
+
+int d3d_board_use_pvs(
+	d3d_board *board,
+	size_t n_parts,
+	const d3d_pvs *const parts[])
+{
+	size_t width = board->width, height = board->height;
+	if (n_parts == 0) {
+		release(&board->alloc, board->pvs);
+		board->pvs = NULL;
+		board->pvs_runs = NULL;
+		return 0;
+	}
+	for (size_t p = 0; p < n_parts; ++p) {
+		if (parts[p]->width != width || parts[p]->height != height)
+			return -1;
+	}
+	// Count the runs, with a run of every cell for uncovered cells:
+	size_t n_runs = 0;
+	for (size_t x = 0; x < width; ++x) {
+		size_t k = 0;
+		const d3d_pvs *part = pvs_part(n_parts, parts, x, &k);
+		n_runs += part ? part->offsets[(k + 1) * height]
+			- part->offsets[k * height] : height;
+		if (n_runs > UINT32_MAX) return -1;
+	}
+	size_t n_cells = width * height;
+	if (n_cells >= SIZE_MAX / sizeof(uint32_t)
+	 || n_runs > SIZE_MAX / 2 / sizeof(uint32_t)) return -1;
+	size_t size = (n_cells + 1) * sizeof(uint32_t);
+	size_t runs_size = n_runs * 2 * sizeof(uint32_t);
+	if (size + runs_size < size) return -1;
+	uint32_t *pvs = allocate(&board->alloc, size + runs_size);
+	if (!pvs) return -1;
+	uint32_t *runs = pvs + n_cells + 1;
+	size_t r = 0;
+	for (size_t x = 0; x < width; ++x) {
+		size_t k = 0;
+		const d3d_pvs *part = pvs_part(n_parts, parts, x, &k);
+		for (size_t y = 0; y < height; ++y) {
+			pvs[y + height * x] = r;
+			if (!part) {
+				runs[2 * r] = 0;
+				runs[2 * r + 1] = n_cells;
+				++r;
+				continue;
+			}
+			uint32_t start = part->offsets[k * height + y];
+			uint32_t end = part->offsets[k * height + y + 1];
+			memcpy(&runs[2 * r], &part->runs[2 * start],
+				(end - start) * 2 * sizeof(*runs));
+			r += end - start;
+		}
+	}
+	pvs[n_cells] = r;
+	release(&board->alloc, board->pvs);
+	board->pvs = pvs;
+	board->pvs_runs = runs;
+	return 0;
+}
+
+int d3d_board_sees(
+	const d3d_board *board,
+	size_t from_x,
+	size_t from_y,
+	size_t to_x,
+	size_t to_y)
+{
+	if (from_x >= board->width || from_y >= board->height
+	 || to_x >= board->width || to_y >= board->height) return 0;
+	if (!board->pvs) return 1;
+	size_t from = from_y + board->height * from_x;
+	return pvs_runs_have(board->pvs_runs + 2 * board->pvs[from],
+		board->pvs[from + 1] - board->pvs[from],
+		to_y + board->height * to_x);
+}
+
+void d3d_free_pvs(d3d_pvs *pvs)
+{
+	if (!pvs) return;
+	release(&pvs->alloc, pvs->runs);
+	release(&pvs->alloc, pvs);
+}
+
+d3d_sprite_index *d3d_new_sprite_index(
+	size_t width,
+	size_t height,
+	size_t bucket_size)
+{
+	return d3d_new_sprite_index_with(width, height, bucket_size, NULL);
+}
+
+d3d_sprite_index *d3d_new_sprite_index_with(
+	size_t width,
+	size_t height,
+	size_t bucket_size,
+	const d3d_allocator_s *alloc)
+{
+	if (bucket_size == 0) bucket_size = 1;
+	size_t buckets_x = width / bucket_size + (width % bucket_size != 0);
+	size_t buckets_y = height / bucket_size + (height % bucket_size != 0);
+	if (buckets_x > 0 && buckets_y > SIZE_MAX / sizeof(size_t) / buckets_x)
+		return NULL;
+	size_t n_buckets = buckets_x * buckets_y;
+	// The bucket heads are glued on after the index:
+	size_t size = sizeof(d3d_sprite_index), heads_offset;
+	ALIGN_SIZE(size, size_t);
+	heads_offset = size;
+	CHECKED_ADD(size, n_buckets * sizeof(size_t));
+	alloc = pick_allocator(alloc);
+	d3d_sprite_index *index = allocate(alloc, size);
+	if (!index) return NULL;
+	index->alloc = *alloc;
+	index->width = width;
+	index->height = height;
+	index->bucket_size = bucket_size;
+	index->buckets_x = buckets_x;
+	index->buckets_y = buckets_y;
+	index->heads = (void *)((char *)index + heads_offset);
+	for (size_t i = 0; i < n_buckets; ++i) {
+		index->heads[i] = NO_ID;
+	}
+	index->entries = NULL;
+	index->n_entries = 0;
+	index->entries_cap = 0;
+	index->n_sprites = 0;
+	index->free = NO_ID;
+	index->reach = 0;
+	index->stamp = 0;
+	return index;
+}
+
+// Get the bucket in which a sprite at pos goes.
+static size_t index_bucket(const d3d_sprite_index *index, d3d_vec_s pos)
+{
+	vec_s p = to_vec(pos);
+	if (!(p.x > (scalar)0.0 && p.y > (scalar)0.0
+	   && p.x < index->width && p.y < index->height))
+		return D3D_INDEX_OUTSIDE;
+	size_t bx = (size_t)p.x / index->bucket_size;
+	size_t by = (size_t)p.y / index->bucket_size;
+	return by + index->buckets_y * bx;
+}
+
+// Put the entry with the given ID at the head of the list of a bucket.
+static void index_link(d3d_sprite_index *index, size_t id, size_t bucket)
+{
+	struct d3d_sprite_index_entry *ent = &index->entries[id];
+	ent->bucket = bucket;
+	ent->prev = ent->next = NO_ID;
+	if (bucket == D3D_INDEX_OUTSIDE) return;
+	ent->next = index->heads[bucket];
+	if (ent->next != NO_ID) index->entries[ent->next].prev = id;
+	index->heads[bucket] = id;
+}
+
+// Take the entry with the given ID out of the list of its bucket.
+static void index_unlink(d3d_sprite_index *index, size_t id)
+{
+	struct d3d_sprite_index_entry *ent = &index->entries[id];
+	if (ent->bucket == D3D_INDEX_OUTSIDE) return;
+	if (ent->prev != NO_ID) {
+		index->entries[ent->prev].next = ent->next;
+	} else {
+		index->heads[ent->bucket] = ent->next;
+	}
+	if (ent->next != NO_ID) index->entries[ent->next].prev = ent->prev;
+}
+
+// Get the entry with the given ID if a sprite has it, or else NULL.
+static struct d3d_sprite_index_entry *index_entry(
+	const d3d_sprite_index *index,
+	size_t id)
+{
+	if (id >= index->n_entries
+	 || index->entries[id].bucket == D3D_INDEX_FREE) return NULL;
+	return &index->entries[id];
+}
+
+// Store a sprite in the entry with the given ID, which must not be linked.
+static void index_store(
+	d3d_sprite_index *index,
+	size_t id,
+	const d3d_sprite_s *sprite)
+{
+	index->entries[id].sprite = *sprite;
+	index->reach = fmax(index->reach, fabs((scalar)sprite->scale.x));
+	index_link(index, id, index_bucket(index, sprite->pos));
+}
+
+size_t d3d_sprite_index_add(
+	d3d_sprite_index *index,
+	const d3d_sprite_s *sprite)
+{
+	size_t id = index->free;
+	if (id != NO_ID) {
+		index->free = index->entries[id].next;
+	} else {
+		if (index->n_entries >= index->entries_cap) {
+			size_t cap = index->entries_cap ?
+				index->entries_cap * 2 : 16;
+			if (cap > SIZE_MAX / sizeof(*index->entries))
+				return NO_ID;
+			struct d3d_sprite_index_entry *entries =
+				index->alloc.resize(index->alloc.ctx,
+					index->entries,
+					index->entries_cap
+						* sizeof(*index->entries),
+					cap * sizeof(*index->entries));
+			if (!entries) return NO_ID;
+			index->entries = entries;
+			index->entries_cap = cap;
+		}
+		id = index->n_entries++;
+	}
+	index->entries[id].stamp = 0;
+	index_store(index, id, sprite);
+	++index->n_sprites;
+	return id;
+}
+
+int d3d_sprite_index_set(
+	d3d_sprite_index *index,
+	size_t id,
+	const d3d_sprite_s *sprite)
+{
+	if (!index_entry(index, id)) return -1;
+	index_unlink(index, id);
+	index_store(index, id, sprite);
+	return 0;
+}
+
+int d3d_sprite_index_move(d3d_sprite_index *index, size_t id, d3d_vec_s pos)
+{
+	struct d3d_sprite_index_entry *ent = index_entry(index, id);
+	if (!ent) return -1;
+	ent->sprite.pos = pos;
+	size_t bucket = index_bucket(index, pos);
+	if (bucket != ent->bucket) {
+		index_unlink(index, id);
+		index_link(index, id, bucket);
+	}
+	return 0;
+}
+
+const d3d_sprite_s *d3d_sprite_index_get(
+	const d3d_sprite_index *index,
+	size_t id)
+{
+	struct d3d_sprite_index_entry *ent = index_entry(index, id);
+	return ent ? &ent->sprite : NULL;
+}
+
+int d3d_sprite_index_remove(d3d_sprite_index *index, size_t id)
+{
+	struct d3d_sprite_index_entry *ent = index_entry(index, id);
+	if (!ent) return -1;
+	index_unlink(index, id);
+	ent->bucket = D3D_INDEX_FREE;
+	ent->next = index->free;
+	index->free = id;
+	--index->n_sprites;
+	return 0;
+}
+
+size_t d3d_sprite_index_count(const d3d_sprite_index *index)
+{
+	return index->n_sprites;
+}
+
+void d3d_free_sprite_index(d3d_sprite_index *index)
+{
+	if (!index) return;
+	release(&index->alloc, index->entries);
+	release(&index->alloc, index);
+}
+
+size_t d3d_camera_width(const d3d_camera *cam)
+{
+	return cam->width;
+}
+
+size_t d3d_camera_height(const d3d_camera *cam)
+{
+	return cam->height;
+}
+
+size_t d3d_camera_sprites_drawn(const d3d_camera *cam)
+{
+	return cam->n_sprites_drawn;
+}
+
+d3d_pixel *d3d_camera_get(d3d_camera *cam, size_t x, size_t y)
+{
+	return GET(cam, pixels, x, y);
+}
+
+size_t d3d_texture_width(const d3d_texture *txtr)
+{
+	return txtr->width;
+}
+
+size_t d3d_texture_height(const d3d_texture *txtr)
+{
+	return txtr->height;
+}
+
+d3d_pixel *d3d_texture_get(d3d_texture *txtr, size_t x, size_t y)
+{
+	return GET(txtr, pixels, x, y);
+}
+
+void d3d_free_texture(d3d_texture *txtr)
+{
+	if (!txtr) return;
+	free_mips(txtr);
+	release(&txtr->alloc, txtr);
+}
+
+size_t d3d_board_width(const d3d_board *board)
+{
+	return board->width;
+}
+
+size_t d3d_board_height(const d3d_board *board)
+{
+	return board->height;
+}
+
+const d3d_block_s **d3d_board_get(d3d_board *board, size_t x, size_t y)
+{
+	if (board->index_size != 0) return NULL;
+	if (board->chunks) {
+		struct d3d_chunk_cache *cache = board->chunks;
+		if (x >= board->width || y >= board->height) return NULL;
+		const d3d_block_s **blk = chunk_block(cache, x, y);
+		if (cache->last == cache->fill_chunk) {
+			// The shared chunk is about to be modified, so give
+			// this position a chunk of its own:
+			size_t e = find_chunk(cache, cache->last_cx,
+				cache->last_cy);
+			// The chunk might not have been kept if memory ran out:
+			if (e == NO_CHUNK) return NULL;
+			const d3d_block_s **blocks = cache->spare;
+			cache->spare = NULL;
+			if (!blocks) {
+				blocks = allocate(cache->alloc,
+					CHUNK_AREA * sizeof(*blocks));
+			}
+			if (!blocks) return NULL;
+			memcpy(blocks, cache->fill_chunk,
+				CHUNK_AREA * sizeof(*blocks));
+			cache->entries[e].blocks = blocks;
+			blk = blocks + (blk - cache->fill_chunk);
+			cache->last = blocks;
+		}
+		return blk;
+	}
+	return GET(board, blocks, x, y);
+}
+
+const d3d_block_s *d3d_board_block(const d3d_board *board, size_t x, size_t y)
+{
+	if (x >= board->width || y >= board->height) return NULL;
+	return board_block(board, x, y);
+}
+
+int d3d_board_set(
+	d3d_board *board,
+	size_t x,
+	size_t y,
+	const d3d_block_s *block)
+{
+	if (x >= board->width || y >= board->height) return -1;
+	size_t i = y + board->height * x;
+	if (board->index_size == 0) {
+		const d3d_block_s **blk = d3d_board_get(board, x, y);
+		if (!blk) return -1;
+		*blk = block ? block : &empty_block;
+	} else {
+		size_t index = 0;
+		if (!block) block = &empty_block;
+		while (board->blocks[index] != block) {
+			if (++index >= board->n_palette) return -1;
+		}
+		if (board->index_size == 1) {
+			((unsigned char *)board->indices)[i] = index;
+		} else {
+			((unsigned short *)board->indices)[i] = index;
+		}
+	}
+	d3d_board_changed(board, x, y);
+	return 0;
+}
+
+// Free what a board owns apart from its own allocation.
+static void free_board_parts(d3d_board *board)
+{
+	if (board->chunks) {
+		struct d3d_chunk_cache *cache = board->chunks;
+		for (size_t e = 0; e < cache->n_chunks; ++e) {
+			unload_chunk(cache, e);
+		}
+		release(cache->alloc, cache->spare);
+	}
+	release(&board->alloc, board->accel);
+	release(&board->alloc, board->pvs);
+}
+
+void d3d_free_board(d3d_board *board)
+{
+	if (!board) return;
+	free_board_parts(board);
+	release(&board->alloc, board);
+}
+
+// The first bytes of level data.
+#define LEVEL_MAGIC "D3DLEVEL"
+
+// The version of the level format written by d3d_save_level.
+#define LEVEL_VERSION 1
+
+// A value stored in level data to check that the byte order is native.
+#define LEVEL_BYTE_ORDER 0x01020304
+
+// Each section of level data is aligned to this many bytes from the start.
+#define LEVEL_ALIGN 64
+
+// The header at the start of level data. All integers in level data are in
+// native byte order. Offsets are in bytes from the start of the data.
+struct level_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	// sizeof(d3d_pixel) where the level was saved.
+	uint32_t pixel_size;
+	// The size in bytes of each palette index in the grid (1 or 2.)
+	uint32_t index_size;
+	uint64_t n_textures, n_blocks;
+	// The dimensions of the board.
+	uint64_t width, height;
+	// Where the arrays of level_texture, level_block, and palette indices
+	// (in the column-major order of boards) are.
+	uint64_t textures_offset, blocks_offset, grid_offset;
+	// The total size of the level data.
+	uint64_t size;
+};
+
+// A texture in level data. Its pixels are column-major like in memory.
+struct level_texture {
+	uint64_t width, height;
+	uint64_t pixels_offset;
+};
+
+// A block in level data. Each face is 1 plus an index into the textures, or 0
+// if the face is empty.
+struct level_block {
+	uint32_t faces[6];
+};
+
+// Check that an array of n items of item_size bytes with the given alignment
+// lies at offset within the level data.
+static bool level_array_ok(
+	const void *data,
+	size_t size,
+	uint64_t offset,
+	uint64_t n,
+	size_t item_size,
+	size_t align)
+{
+	if (offset > size || n > (size - offset) / item_size) return false;
+	return (uintptr_t)((const char *)data + offset) % align == 0;
+}
+
+d3d_level *d3d_load_level(void *data, size_t size)
+{
+	return d3d_load_level_with(data, size, NULL);
+}
+
+d3d_level *d3d_load_level_with(
+	void *data,
+	size_t size,
+	const d3d_allocator_s *alloc)
+{
+	const struct level_header *head = data;
+	size_t alloc_size, level_offset, textures_offset, blocks_offset;
+	if (!level_array_ok(data, size, 0, 1, sizeof(*head),
+			ALIGNOF(struct level_header))
+	 || memcmp(head->magic, LEVEL_MAGIC, sizeof(head->magic))
+	 || head->version != LEVEL_VERSION
+	 || head->byte_order != LEVEL_BYTE_ORDER
+	 || head->pixel_size != sizeof(d3d_pixel)
+	 || head->n_blocks < 1 || head->n_blocks > 65536
+	 || head->index_size != (head->n_blocks <= 256 ? 1u : 2u)
+	 || head->size != size
+	 || head->width > SIZE_MAX || head->height > SIZE_MAX
+	 || (head->width != 0 && head->height > SIZE_MAX / head->width)
+	 || !level_array_ok(data, size, head->textures_offset,
+			head->n_textures, sizeof(struct level_texture),
+			ALIGNOF(struct level_texture))
+	 || !level_array_ok(data, size, head->blocks_offset, head->n_blocks,
+			sizeof(struct level_block), ALIGNOF(struct level_block))
+	 || !level_array_ok(data, size, head->grid_offset,
+			head->width * head->height, head->index_size,
+			head->index_size))
+		return NULL;
+	const struct level_texture *ltxtrs =
+		(void *)((char *)data + head->textures_offset);
+	const struct level_block *lblocks =
+		(void *)((char *)data + head->blocks_offset);
+	for (size_t i = 0; i < head->n_textures; ++i) {
+		const struct level_texture *lt = &ltxtrs[i];
+		if (lt->width < 1 || lt->height < 1
+		 || lt->height > SIZE_MAX / lt->width
+		 || !level_array_ok(data, size, lt->pixels_offset,
+				lt->width * lt->height, sizeof(d3d_pixel),
+				ALIGNOF(d3d_pixel)))
+			return NULL;
+	}
+	for (size_t i = 0; i < head->n_blocks; ++i) {
+		for (int f = 0; f < 6; ++f) {
+			if (lblocks[i].faces[f] > head->n_textures) return NULL;
+		}
+	}
+	// The board, the level, its textures, and its blocks are all in one
+	// allocation, in that order. Only the palette indices of the board stay
+	// in the data. The grid is not checked, so the board's table of blocks
+	// covers every index of its size, with empty blocks past the palette:
+	size_t n_indices = head->index_size == 1 ? 256 : 65536;
+	alloc_size = offsetof(d3d_board, blocks);
+	CHECKED_ADD(alloc_size, n_indices * sizeof(d3d_block_s *));
+	ALIGN_SIZE(alloc_size, d3d_level);
+	level_offset = alloc_size;
+	CHECKED_ADD(alloc_size, sizeof(d3d_level));
+	ALIGN_SIZE(alloc_size, d3d_texture);
+	textures_offset = alloc_size;
+	if (head->n_textures > SIZE_MAX / sizeof(d3d_texture)) return NULL;
+	CHECKED_ADD(alloc_size, head->n_textures * sizeof(d3d_texture));
+	ALIGN_SIZE(alloc_size, d3d_block_s);
+	blocks_offset = alloc_size;
+	CHECKED_ADD(alloc_size, head->n_blocks * sizeof(d3d_block_s));
+	alloc = pick_allocator(alloc);
+	d3d_board *board = allocate(alloc, alloc_size);
+	if (!board) return NULL;
+	d3d_level *level = (void *)((char *)board + level_offset);
+	level->board = board;
+	level->n_textures = head->n_textures;
+	level->textures = (void *)((char *)board + textures_offset);
+	level->blocks = (void *)((char *)board + blocks_offset);
+	for (size_t i = 0; i < level->n_textures; ++i) {
+		d3d_texture *txtr = &level->textures[i];
+		init_texture(txtr, ltxtrs[i].width, ltxtrs[i].height,
+			(void *)((char *)data + ltxtrs[i].pixels_offset), alloc);
+	}
+	init_board(level->board, head->width, head->height, alloc);
+	level->board->index_size = head->index_size;
+	level->board->n_palette = head->n_blocks;
+	level->board->indices = (char *)data + head->grid_offset;
+	for (size_t i = 0; i < head->n_blocks; ++i) {
+		for (int f = 0; f < 6; ++f) {
+			uint32_t t = lblocks[i].faces[f];
+			level->blocks[i].faces[f] =
+				t ? &level->textures[t - 1] : NULL;
 		}
+		level->board->blocks[i] = &level->blocks[i];
 	}
+	for (size_t i = head->n_blocks; i < n_indices; ++i) {
+		level->board->blocks[i] = &empty_block;
+	}
+	return level;
 }
 
-static void draw_sprites(
-	d3d_camera *cam,
-	d3d_vec_s cam_pos,
-	d3d_scalar cam_facing,
-	size_t n_sprites,
-	const d3d_sprite_s sprites[])
+size_t d3d_level_n_textures(const d3d_level *level)
 {
-	size_t i;
-	if (n_sprites == cam->last_n_sprites && sprites == cam->last_sprites) {
-		// This assumes the sprites didn't move much, and are mostly
-		// sorted. Therefore, insertion sort is used.
-		for (i = 0; i < n_sprites; ++i) {
-			size_t move_to;
-			struct d3d_sprite_order ord = cam->order[i];
-			size_t s = ord.index;
-			ord.dist = hypot(sprites[s].pos.x - cam_pos.x,
-				sprites[s].pos.y - cam_pos.y);
-			move_to = i;
-			for (long j = (long)i - 1; j >= 0; --j) {
-				if (cam->order[j].dist <= ord.dist) break;
-				move_to = j;
-			}
-			memmove(cam->order + move_to + 1, cam->order + move_to,
-				(i - move_to) * sizeof(*cam->order));
-			cam->order[move_to] = ord;
-	       }
+	return level->n_textures;
+}
+
+d3d_texture *d3d_level_texture(d3d_level *level, size_t i)
+{
+	return i < level->n_textures ? &level->textures[i] : NULL;
+}
+
+d3d_board *d3d_level_board(d3d_level *level)
+{
+	return level->board;
+}
+
+void d3d_free_level(d3d_level *level)
+{
+	if (!level) return;
+	for (size_t i = 0; i < level->n_textures; ++i) {
+		free_mips(&level->textures[i]);
+	}
+	free_board_parts(level->board);
+	// The level is glued on after the board:
+	release(&level->board->alloc, level->board);
+}
+
+// The capacity of the hash table used to find distinct blocks when saving.
+#define SAVE_TABLE_CAP (65536 * 2)
+
+// Find the palette index of a block when saving a level, adding the block to
+// the palette if it is new. The table maps blocks to indices. -1 is returned if
+// the palette is full.
+static long save_block_index(
+	const d3d_block_s **table,
+	unsigned short *indices,
+	const d3d_block_s **palette,
+	size_t *n_palette,
+	const d3d_block_s *block)
+{
+	size_t slot = (size_t)((uintptr_t)block / ALIGNOF(d3d_block_s)
+		* (uintptr_t)0x9E3779B97F4A7C15ull) % SAVE_TABLE_CAP;
+	while (table[slot]) {
+		if (table[slot] == block) return indices[slot];
+		slot = (slot + 1) % SAVE_TABLE_CAP;
+	}
+	if (*n_palette >= 65536) return -1;
+	table[slot] = block;
+	indices[slot] = *n_palette;
+	palette[*n_palette] = block;
+	return (*n_palette)++;
+}
+
+// Write n zero bytes to a file, returning whether it worked.
+static bool write_zeros(FILE *file, size_t n)
+{
+	while (n--) {
+		if (putc(0, file) == EOF) return false;
+	}
+	return true;
+}
+
+// Round a level data offset up to LEVEL_ALIGN.
+static uint64_t level_align(uint64_t offset)
+{
+	return (offset + LEVEL_ALIGN - 1) / LEVEL_ALIGN * LEVEL_ALIGN;
+}
+
+// Write a level like d3d_save_level, also storing the size of the level data in
+// size if it works.
+static int save_level(
+	FILE *file,
+	const d3d_board *board,
+	size_t n_textures,
+	const d3d_texture *const textures[],
+	uint64_t *size)
+{
+	int ret = -1;
+	size_t n_palette = 0;
+	struct level_header head;
+	const d3d_block_s **palette = NULL, **table = NULL;
+	unsigned short *indices = NULL;
+	void *column = NULL;
+	// Face indices are stored as one more than texture indices:
+	if (n_textures >= UINT32_MAX) goto end;
+	// Find the distinct blocks. Palette boards don't need a search.
+	palette = d3d_malloc(65536 * sizeof(*palette));
+	if (!palette) goto end;
+	if (board->index_size != 0) {
+		n_palette = board->n_palette;
+		memcpy(palette, board->blocks, n_palette * sizeof(*palette));
 	} else {
-		if (n_sprites > cam->order_buf_cap) {
-			struct d3d_sprite_order *new_order;
-			size_t size = n_sprites * sizeof(*cam->order);
-			if (size / sizeof(*cam->order) == n_sprites
-			 && (new_order = d3d_realloc(cam->order, size))) {
-				cam->order = new_order;
-				cam->order_buf_cap = n_sprites;
-			} else {
-				// XXX Silently truncate the list of sprites
-				// drawn. This may be a bad decision, but
-				// failure is unlikely and this shouldn't break
-				// any client code.
-				n_sprites = cam->order_buf_cap;
+		table = d3d_malloc(SAVE_TABLE_CAP * sizeof(*table));
+		indices = d3d_malloc(SAVE_TABLE_CAP * sizeof(*indices));
+		if (!table || !indices) goto end;
+		for (size_t i = 0; i < SAVE_TABLE_CAP; ++i) {
+			table[i] = NULL;
+		}
+		for (size_t x = 0; x < board->width; ++x) {
+			for (size_t y = 0; y < board->height; ++y) {
+				if (save_block_index(table, indices, palette,
+					&n_palette, board_block(board, x, y)) < 0)
+					goto end;
 			}
 		}
-		for (i = 0; i < n_sprites; ++i) {
-			struct d3d_sprite_order *ord = &cam->order[i];
-			ord->dist = hypot(sprites[i].pos.x - cam_pos.x,
-				sprites[i].pos.y - cam_pos.y);
-			ord->index = i;
+		if (n_palette == 0) palette[n_palette++] = &empty_block;
+	}
+	memcpy(head.magic, LEVEL_MAGIC, sizeof(head.magic));
+	head.version = LEVEL_VERSION;
+	head.byte_order = LEVEL_BYTE_ORDER;
+	head.pixel_size = sizeof(d3d_pixel);
+	head.index_size = n_palette <= 256 ? 1 : 2;
+	head.n_textures = n_textures;
+	head.n_blocks = n_palette;
+	head.width = board->width;
+	head.height = board->height;
+	head.textures_offset = level_align(sizeof(head));
+	head.blocks_offset = level_align(head.textures_offset
+		+ n_textures * sizeof(struct level_texture));
+	head.grid_offset = level_align(head.blocks_offset
+		+ n_palette * sizeof(struct level_block));
+	head.size = head.grid_offset
+		+ (uint64_t)board->width * board->height * head.index_size;
+	for (size_t i = 0; i < n_textures; ++i) {
+		head.size = level_align(head.size) + (uint64_t)textures[i]->width
+			* textures[i]->height * sizeof(d3d_pixel);
+	}
+	// The header, then the texture table:
+	if (fwrite(&head, sizeof(head), 1, file) != 1
+	 || !write_zeros(file, head.textures_offset - sizeof(head)))
+		goto end;
+	uint64_t pos = level_align(head.grid_offset
+		+ (uint64_t)board->width * board->height * head.index_size);
+	for (size_t i = 0; i < n_textures; ++i) {
+		struct level_texture lt;
+		lt.width = textures[i]->width;
+		lt.height = textures[i]->height;
+		lt.pixels_offset = pos;
+		if (fwrite(&lt, sizeof(lt), 1, file) != 1) goto end;
+		pos = level_align(pos + lt.width * lt.height
+			* sizeof(d3d_pixel));
+	}
+	if (!write_zeros(file, head.blocks_offset - head.textures_offset
+			- n_textures * sizeof(struct level_texture)))
+		goto end;
+	// The block table:
+	for (size_t i = 0; i < n_palette; ++i) {
+		struct level_block lb;
+		for (int f = 0; f < 6; ++f) {
+			const d3d_texture *face = palette[i]->faces[f];
+			lb.faces[f] = 0;
+			if (!face) continue;
+			// The index is one more than that of the texture:
+			size_t t = 0;
+			while (t < n_textures && textures[t] != face) ++t;
+			if (t >= n_textures) goto end;
+			lb.faces[f] = t + 1;
 		}
-		qsort(cam->order, n_sprites, sizeof(*cam->order),
-			compar_sprite_order);
-		cam->last_sprites = sprites;
-		cam->last_n_sprites = n_sprites;
+		if (fwrite(&lb, sizeof(lb), 1, file) != 1) goto end;
 	}
-	i = n_sprites;
-	while (i--) {
-		struct d3d_sprite_order *ord = &cam->order[i];
-		draw_sprite_dist(cam, cam_pos, cam_facing, &sprites[ord->index],
-			ord->dist);
+	if (!write_zeros(file, head.grid_offset - head.blocks_offset
+			- n_palette * sizeof(struct level_block)))
+		goto end;
+	// The grid, a column at a time:
+	if (board->height > SIZE_MAX / 2) goto end;
+	column = d3d_malloc(board->height * head.index_size + 1);
+	if (!column) goto end;
+	for (size_t x = 0; x < board->width; ++x) {
+		for (size_t y = 0; y < board->height; ++y) {
+			size_t index;
+			if (board->index_size == 1) {
+				index = ((const unsigned char *)board->indices)
+					[y + board->height * x];
+			} else if (board->index_size == 2) {
+				index = ((const unsigned short *)board->indices)
+					[y + board->height * x];
+			} else {
+				index = save_block_index(table, indices,
+					palette, &n_palette,
+					board_block(board, x, y));
+			}
+			if (head.index_size == 1) {
+				((unsigned char *)column)[y] = index;
+			} else {
+				((unsigned short *)column)[y] = index;
+			}
+		}
+		if (fwrite(column, head.index_size, board->height, file)
+			!= board->height) goto end;
+	}
+	// The pixels:
+	pos = head.grid_offset
+		+ (uint64_t)board->width * board->height * head.index_size;
+	for (size_t i = 0; i < n_textures; ++i) {
+		size_t n_pixels = textures[i]->width * textures[i]->height;
+		if (!write_zeros(file, level_align(pos) - pos)
+		 || fwrite(textures[i]->pixels, sizeof(d3d_pixel), n_pixels,
+			file) != n_pixels) goto end;
+		pos = level_align(pos) + n_pixels * sizeof(d3d_pixel);
 	}
+	*size = head.size;
+	ret = 0;
+end:
+	d3d_free(column);
+	d3d_free(indices);
+	d3d_free(table);
+	d3d_free(palette);
+	return ret;
 }
 
-void d3d_draw(
+int d3d_save_level(
+	FILE *file,
+	const d3d_board *board,
+	size_t n_textures,
+	const d3d_texture *const textures[])
+{
+	uint64_t size;
+	return save_level(file, board, n_textures, textures, &size);
+}
+
+// The first bytes of capture data.
+#define CAPTURE_MAGIC "D3DCAPTR"
+
+// The version of the capture format written by d3d_capture.
+#define CAPTURE_VERSION 1
+
+// Records in capture data are padded to multiples of this many bytes.
+#define CAPTURE_ALIGN 16
+
+// The header at the start of capture data. Level data for the board and
+// textures comes after it at offset LEVEL_ALIGN, and a series of records comes
+// after that, starting at the next multiple of LEVEL_ALIGN. Like in level data,
+// everything is in native byte order and layout.
+struct capture_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	// sizeof(d3d_pixel) and sizeof(d3d_scalar) where the data was captured.
+	uint32_t pixel_size, scalar_size;
+	// Whether the board was accelerated.
+	uint32_t accelerated;
+	uint32_t reserved;
+};
+
+// The kinds of records in capture data.
+enum capture_type {
+	// A struct capture_camera followed by the shading tables, if any.
+	CAPTURE_CAMERA = 1,
+	// A struct capture_block.
+	CAPTURE_BLOCK,
+	// A struct capture_frame followed by its struct capture_sprites.
+	CAPTURE_FRAME
+};
+
+// The header of a record. The contents are size bytes long, and size is a
+// multiple of CAPTURE_ALIGN.
+struct capture_record {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t size;
+};
+
+// Camera settings. max_dist is 0 if there is no limit.
+struct capture_camera {
+	d3d_scalar fovx, fovy, max_dist, band_depth;
+	uint64_t width, height, n_bands, lut_size;
+	d3d_pixel empty, fog;
+};
+
+// A change of one block. The faces are as in struct level_block.
+struct capture_block {
+	uint64_t x, y;
+	uint32_t faces[6];
+};
+
+// A call to d3d_draw and the hash of the pixels it drew.
+struct capture_frame {
+	d3d_scalar x, y, facing;
+	uint64_t n_sprites;
+	uint64_t hash;
+};
+
+// A sprite in a frame. txtr is an index into the textures.
+struct capture_sprite {
+	d3d_scalar x, y, scale_x, scale_y;
+	d3d_pixel transparent;
+	uint32_t txtr;
+};
+
+// Hash the pixels of a camera with 64-bit FNV-1a.
+static uint64_t hash_pixels(const d3d_camera *cam)
+{
+	const unsigned char *bytes = (const void *)cam->pixels;
+	size_t size = cam->width * cam->height * sizeof(d3d_pixel);
+	uint64_t hash = 0xcbf29ce484222325u;
+	for (size_t i = 0; i < size; ++i) {
+		hash = (hash ^ bytes[i]) * 0x100000001b3u;
+	}
+	return hash;
+}
+
+// Compare capture textures by address. This is meant for qsort and bsearch.
+static int compar_capture_texture(const void *a, const void *b)
+{
+	const struct d3d_capture_texture *ta = a, *tb = b;
+	uintptr_t addr_a = (uintptr_t)ta->txtr, addr_b = (uintptr_t)tb->txtr;
+	if (addr_a > addr_b) return 1;
+	if (addr_a < addr_b) return -1;
+	return 0;
+}
+
+// Find the index of a texture in a capture. -1 is returned if it is not there.
+static long capture_texture_index(
+	const d3d_capture *cap,
+	const d3d_texture *txtr)
+{
+	struct d3d_capture_texture key = { txtr, 0 };
+	const struct d3d_capture_texture *found = bsearch(&key, cap->textures,
+		cap->n_textures, sizeof(key), compar_capture_texture);
+	return found ? (long)found->index : -1;
+}
+
+// Write a record header for contents of the given size, returning whether it
+// worked. The contents must be padded with capture_pad afterward.
+static bool capture_record(
+	d3d_capture *cap,
+	enum capture_type type,
+	size_t size)
+{
+	struct capture_record rec;
+	rec.type = type;
+	rec.reserved = 0;
+	rec.size = (size + CAPTURE_ALIGN - 1) / CAPTURE_ALIGN * CAPTURE_ALIGN;
+	return fwrite(&rec, sizeof(rec), 1, cap->file) == 1;
+}
+
+// Write the padding after record contents of the given size.
+static bool capture_pad(d3d_capture *cap, size_t size)
+{
+	return write_zeros(cap->file, (CAPTURE_ALIGN - size % CAPTURE_ALIGN)
+		% CAPTURE_ALIGN);
+}
+
+d3d_capture *d3d_new_capture(
+	FILE *file,
+	const d3d_board *board,
+	size_t n_textures,
+	const d3d_texture *const textures[])
+{
+	return d3d_new_capture_with(file, board, n_textures, textures, NULL);
+}
+
+d3d_capture *d3d_new_capture_with(
+	FILE *file,
+	const d3d_board *board,
+	size_t n_textures,
+	const d3d_texture *const textures[],
+	const d3d_allocator_s *alloc)
+{
+	size_t size = sizeof(d3d_capture);
+	ALIGN_SIZE(size, struct d3d_capture_texture);
+	size_t textures_offset = size;
+	if (n_textures > UINT32_MAX
+	 || n_textures > SIZE_MAX / sizeof(struct d3d_capture_texture))
+		return NULL;
+	CHECKED_ADD(size, n_textures * sizeof(struct d3d_capture_texture));
+	alloc = pick_allocator(alloc);
+	d3d_capture *cap = allocate(alloc, size);
+	if (!cap) return NULL;
+	cap->alloc = *alloc;
+	cap->file = file;
+	cap->n_textures = n_textures;
+	cap->textures = (void *)((char *)cap + textures_offset);
+	for (size_t i = 0; i < n_textures; ++i) {
+		cap->textures[i].txtr = textures[i];
+		cap->textures[i].index = i;
+	}
+	qsort(cap->textures, n_textures, sizeof(*cap->textures),
+		compar_capture_texture);
+	for (int i = 0; i < 2; ++i) {
+		cap->cameras[i] = NULL;
+		cap->camera_sizes[i] = 0;
+		cap->camera_caps[i] = 0;
+	}
+	struct capture_header head;
+	memset(&head, 0, sizeof(head));
+	memcpy(head.magic, CAPTURE_MAGIC, sizeof(head.magic));
+	head.version = CAPTURE_VERSION;
+	head.byte_order = LEVEL_BYTE_ORDER;
+	head.pixel_size = sizeof(d3d_pixel);
+	head.scalar_size = sizeof(d3d_scalar);
+	head.accelerated = board->accel != NULL;
+	uint64_t level_size;
+	if (fwrite(&head, sizeof(head), 1, cap->file) != 1
+	 || !write_zeros(file, LEVEL_ALIGN - sizeof(head))
+	 || save_level(file, board, n_textures, textures, &level_size)
+	 || !write_zeros(file, level_align(level_size) - level_size))
+		goto error;
+	return cap;
+
+error:
+	release(&cap->alloc, cap);
+	return NULL;
+}
+
+// Write the settings of a camera to a capture if they changed since they were
+// last written, returning whether it worked.
+static bool capture_camera(d3d_capture *cap, const d3d_camera *cam)
+{
+	size_t luts_size = cam->n_bands * cam->lut_size * sizeof(d3d_pixel);
+	size_t size = sizeof(struct capture_camera) + luts_size;
+	if (size > cap->camera_caps[1]) {
+		void *buf = cap->alloc.resize(cap->alloc.ctx, cap->cameras[1],
+			cap->camera_caps[1], size);
+		if (!buf) return false;
+		cap->cameras[1] = buf;
+		cap->camera_caps[1] = size;
+	}
+	struct capture_camera *cc = cap->cameras[1];
+	memset(cc, 0, sizeof(*cc));
+	cc->fovx = cam->fov.x;
+	cc->fovy = cam->fov.y;
+	cc->max_dist = cam->max_dist == INFINITY ? 0 : cam->max_dist;
+	cc->band_depth = cam->n_bands > 0 ? cam->band_depth : 0;
+	cc->width = cam->width;
+	cc->height = cam->height;
+	cc->n_bands = cam->n_bands;
+	cc->lut_size = cam->lut_size;
+	cc->empty = camera_empty_pixel((d3d_camera *)cam);
+	cc->fog = cam->fog->pixels[0];
+	if (luts_size > 0) memcpy(cc + 1, cam->luts, luts_size);
+	cap->camera_sizes[1] = size;
+	if (size == cap->camera_sizes[0]
+	 && !memcmp(cap->cameras[0], cap->cameras[1], size)) return true;
+	if (!capture_record(cap, CAPTURE_CAMERA, size)
+	 || fwrite(cc, size, 1, cap->file) != 1
+	 || !capture_pad(cap, size)) return false;
+	// The new settings are now the last ones written:
+	void *buf = cap->cameras[0];
+	cap->cameras[0] = cap->cameras[1];
+	cap->cameras[1] = buf;
+	size_t cap_size = cap->camera_caps[0];
+	cap->camera_caps[0] = cap->camera_caps[1];
+	cap->camera_caps[1] = cap_size;
+	cap->camera_sizes[0] = size;
+	return true;
+}
+
+int d3d_capture_draw(
+	d3d_capture *cap,
 	d3d_camera *cam,
 	d3d_vec_s cam_pos,
 	d3d_scalar cam_facing,
@@ -557,71 +3529,555 @@ void d3d_draw(
 	size_t n_sprites,
 	const d3d_sprite_s sprites[])
 {
-	if (cam_pos.x > (d3d_scalar)0.0 && cam_pos.y > (d3d_scalar)0.0
-	 && cam_pos.x < board->width && cam_pos.y < board->height) {
-		// Canonicalize camera direction:
-		cam_facing = fmod(cam_facing, 2 * PI);
-		if (cam_facing < (d3d_scalar)0.0) cam_facing += 2 * PI;
-		for (size_t x = 0; x < cam->width; ++x) {
-			draw_column(cam, cam_pos, cam_facing, board, x);
+	d3d_draw(cam, cam_pos, cam_facing, board, n_sprites, sprites);
+	// Check the textures before anything is written:
+	for (size_t i = 0; i < n_sprites; ++i) {
+		if (capture_texture_index(cap, sprites[i].txtr) < 0) return -1;
+	}
+	if (!capture_camera(cap, cam)) return -1;
+	struct capture_frame frame;
+	memset(&frame, 0, sizeof(frame));
+	frame.x = cam_pos.x;
+	frame.y = cam_pos.y;
+	frame.facing = cam_facing;
+	frame.n_sprites = n_sprites;
+	frame.hash = hash_pixels(cam);
+	size_t size = sizeof(frame) + n_sprites * sizeof(struct capture_sprite);
+	if (!capture_record(cap, CAPTURE_FRAME, size)
+	 || fwrite(&frame, sizeof(frame), 1, cap->file) != 1) return -1;
+	for (size_t i = 0; i < n_sprites; ++i) {
+		const d3d_sprite_s *sp = &sprites[i];
+		struct capture_sprite cs;
+		memset(&cs, 0, sizeof(cs));
+		cs.x = sp->pos.x;
+		cs.y = sp->pos.y;
+		cs.scale_x = sp->scale.x;
+		cs.scale_y = sp->scale.y;
+		cs.transparent = sp->transparent;
+		cs.txtr = capture_texture_index(cap, sp->txtr);
+		if (fwrite(&cs, sizeof(cs), 1, cap->file) != 1) return -1;
+	}
+	return capture_pad(cap, size) ? 0 : -1;
+}
+
+int d3d_capture_set_block(
+	d3d_capture *cap,
+	d3d_board *board,
+	size_t x,
+	size_t y,
+	const d3d_block_s *block)
+{
+	struct capture_block cb;
+	memset(&cb, 0, sizeof(cb));
+	cb.x = x;
+	cb.y = y;
+	for (int f = 0; f < 6; ++f) {
+		const d3d_texture *face = block ? block->faces[f] : NULL;
+		if (!face) continue;
+		long index = capture_texture_index(cap, face);
+		if (index < 0) return -1;
+		cb.faces[f] = index + 1;
+	}
+	if (d3d_board_set(board, x, y, block)
+	 || !capture_record(cap, CAPTURE_BLOCK, sizeof(cb))
+	 || fwrite(&cb, sizeof(cb), 1, cap->file) != 1
+	 || !capture_pad(cap, sizeof(cb))) return -1;
+	return 0;
+}
+
+void d3d_free_capture(d3d_capture *cap)
+{
+	if (!cap) return;
+	release(&cap->alloc, cap->cameras[0]);
+	release(&cap->alloc, cap->cameras[1]);
+	release(&cap->alloc, cap);
+}
+
+d3d_replay *d3d_load_replay(void *data, size_t size)
+{
+	return d3d_load_replay_with(data, size, NULL);
+}
+
+d3d_replay *d3d_load_replay_with(
+	void *data,
+	size_t size,
+	const d3d_allocator_s *alloc)
+{
+	const struct capture_header *head = data;
+	const struct level_header *level_head =
+		(void *)((char *)data + LEVEL_ALIGN);
+	if (!level_array_ok(data, size, 0, 1, sizeof(*head),
+			ALIGNOF(struct capture_header))
+	 || memcmp(head->magic, CAPTURE_MAGIC, sizeof(head->magic))
+	 || head->version != CAPTURE_VERSION
+	 || head->byte_order != LEVEL_BYTE_ORDER
+	 || head->pixel_size != sizeof(d3d_pixel)
+	 || head->scalar_size != sizeof(d3d_scalar)
+	 || !level_array_ok(data, size, LEVEL_ALIGN, 1, sizeof(*level_head),
+			ALIGNOF(struct level_header))
+	 || level_head->size > size - LEVEL_ALIGN
+	 || level_align(LEVEL_ALIGN + level_head->size) > size)
+		return NULL;
+	alloc = pick_allocator(alloc);
+	d3d_replay *rp = allocate(alloc, sizeof(*rp));
+	if (!rp) return NULL;
+	rp->alloc = *alloc;
+	rp->data = data;
+	rp->size = size;
+	rp->offset = level_align(LEVEL_ALIGN + level_head->size);
+	rp->level = d3d_load_level_with((char *)data + LEVEL_ALIGN,
+		level_head->size, alloc);
+	rp->cam = NULL;
+	rp->pos.x = rp->pos.y = 0;
+	rp->facing = 0;
+	rp->sprites = NULL;
+	rp->n_sprites = 0;
+	rp->sprites_cap = 0;
+	rp->hash = 0;
+	if (!rp->level
+	 || (head->accelerated && d3d_board_accelerate(rp->level->board))) {
+		d3d_free_replay(rp);
+		return NULL;
+	}
+	return rp;
+}
+
+// Replay new camera settings. -1 is returned on failure and 0 on success.
+static int replay_camera(d3d_replay *rp, const char *contents, size_t size)
+{
+	const struct capture_camera *cc = (const void *)contents;
+	if (size < sizeof(*cc)
+	 || cc->width < 1 || cc->height < 1
+	 || cc->width > SIZE_MAX || cc->height > SIZE_MAX
+	 || (cc->n_bands > 0 && cc->lut_size >
+	 	(size - sizeof(*cc)) / sizeof(d3d_pixel) / cc->n_bands))
+		return -1;
+	d3d_camera *cam = d3d_new_camera_with(cc->fovx, cc->fovy, cc->width,
+		cc->height, cc->empty, &rp->alloc);
+	if (!cam) return -1;
+	d3d_camera_set_view_dist(cam, cc->max_dist, cc->fog);
+	if (cc->n_bands > 0 && cc->lut_size > 0
+	 && d3d_camera_set_shading(cam, cc->n_bands, cc->band_depth,
+	 	cc->lut_size, (const d3d_pixel *)(cc + 1))) {
+		d3d_free_camera(cam);
+		return -1;
+	}
+	d3d_free_camera(rp->cam);
+	rp->cam = cam;
+	return 0;
+}
+
+// Replay a block change. -1 is returned on failure and 0 on success.
+static int replay_block(d3d_replay *rp, const char *contents, size_t size)
+{
+	const struct capture_block *cb = (const void *)contents;
+	d3d_level *level = rp->level;
+	if (size < sizeof(*cb)) return -1;
+	const d3d_texture *faces[6];
+	for (int f = 0; f < 6; ++f) {
+		if (cb->faces[f] > level->n_textures) return -1;
+		faces[f] = cb->faces[f] ?
+			&level->textures[cb->faces[f] - 1] : NULL;
+	}
+	// Find a block in the palette with the same faces:
+	for (size_t i = 0; i < level->board->n_palette; ++i) {
+		const d3d_block_s *block = level->board->blocks[i];
+		if (!memcmp(block->faces, faces, sizeof(faces))) {
+			return cb->x <= SIZE_MAX && cb->y <= SIZE_MAX ?
+				d3d_board_set(level->board, cb->x, cb->y, block)
+				: -1;
 		}
-		draw_sprites(cam, cam_pos, cam_facing, n_sprites, sprites);
-	} else {
-		empty_camera_pixels(cam);
 	}
+	return -1;
 }
 
-size_t d3d_camera_width(const d3d_camera *cam)
+// Set up a frame to replay. -1 is returned on failure and 1 on success.
+static int replay_frame(d3d_replay *rp, const char *contents, size_t size)
 {
-	return cam->width;
+	const struct capture_frame *cf = (const void *)contents;
+	if (!rp->cam || size < sizeof(*cf)
+	 || cf->n_sprites > (size - sizeof(*cf))
+	 	/ sizeof(struct capture_sprite)) return -1;
+	const struct capture_sprite *cs = (const void *)(cf + 1);
+	size_t n_sprites = cf->n_sprites;
+	if (n_sprites > rp->sprites_cap) {
+		d3d_sprite_s *sprites = rp->alloc.resize(rp->alloc.ctx,
+			rp->sprites, rp->sprites_cap * sizeof(*sprites),
+			n_sprites * sizeof(*sprites));
+		if (!sprites) return -1;
+		rp->sprites = sprites;
+		rp->sprites_cap = n_sprites;
+	}
+	for (size_t i = 0; i < n_sprites; ++i) {
+		d3d_sprite_s *sp = &rp->sprites[i];
+		if (cs[i].txtr >= rp->level->n_textures) return -1;
+		sp->pos.x = cs[i].x;
+		sp->pos.y = cs[i].y;
+		sp->scale.x = cs[i].scale_x;
+		sp->scale.y = cs[i].scale_y;
+		sp->txtr = &rp->level->textures[cs[i].txtr];
+		sp->transparent = cs[i].transparent;
+	}
+	rp->n_sprites = n_sprites;
+	rp->pos.x = cf->x;
+	rp->pos.y = cf->y;
+	rp->facing = cf->facing;
+	rp->hash = cf->hash;
+	return 1;
 }
 
-size_t d3d_camera_height(const d3d_camera *cam)
+int d3d_replay_next(d3d_replay *rp)
 {
-	return cam->height;
+	for (;;) {
+		if (rp->offset >= rp->size) return 0;
+		const struct capture_record *rec =
+			(void *)(rp->data + rp->offset);
+		if (!level_array_ok(rp->data, rp->size, rp->offset, 1,
+				sizeof(*rec), ALIGNOF(struct capture_record))
+		 || rec->size % CAPTURE_ALIGN != 0
+		 || rec->size > rp->size - rp->offset - sizeof(*rec))
+			return -1;
+		const char *contents = (char *)(rec + 1);
+		size_t size = rec->size;
+		rp->offset += sizeof(*rec) + size;
+		switch (rec->type) {
+		case CAPTURE_CAMERA:
+			if (replay_camera(rp, contents, size)) return -1;
+			break;
+		case CAPTURE_BLOCK:
+			if (replay_block(rp, contents, size)) return -1;
+			break;
+		case CAPTURE_FRAME:
+			return replay_frame(rp, contents, size);
+		default:
+			return -1;
+		}
+	}
 }
 
-d3d_pixel *d3d_camera_get(d3d_camera *cam, size_t x, size_t y)
+void d3d_replay_draw(d3d_replay *rp)
 {
-	return GET(cam, pixels, x, y);
+	if (!rp->cam) return;
+	d3d_draw(rp->cam, rp->pos, rp->facing, rp->level->board, rp->n_sprites,
+		rp->sprites);
 }
 
-size_t d3d_texture_width(const d3d_texture *txtr)
+int d3d_replay_check(const d3d_replay *rp)
 {
-	return txtr->width;
+	return rp->cam && hash_pixels(rp->cam) == rp->hash;
 }
 
-size_t d3d_texture_height(const d3d_texture *txtr)
+d3d_camera *d3d_replay_camera(d3d_replay *rp)
 {
-	return txtr->height;
+	return rp->cam;
 }
 
-d3d_pixel *d3d_texture_get(d3d_texture *txtr, size_t x, size_t y)
+d3d_board *d3d_replay_board(d3d_replay *rp)
 {
-	return GET(txtr, pixels, x, y);
+	return rp->level->board;
 }
 
-void d3d_free_texture(d3d_texture *txtr)
+void d3d_free_replay(d3d_replay *rp)
 {
-	d3d_free(txtr);
+	if (!rp) return;
+	d3d_free_camera(rp->cam);
+	release(&rp->alloc, rp->sprites);
+	d3d_free_level(rp->level);
+	release(&rp->alloc, rp);
 }
 
-size_t d3d_board_width(const d3d_board *board)
+d3d_frame_differ *d3d_new_frame_differ(size_t width, size_t height)
 {
-	return board->width;
+	return d3d_new_frame_differ_with(width, height, NULL);
 }
 
-size_t d3d_board_height(const d3d_board *board)
+d3d_frame_differ *d3d_new_frame_differ_with(
+	size_t width,
+	size_t height,
+	const d3d_allocator_s *alloc)
 {
-	return board->height;
+	size_t n_pixels = width * height;
+	if (width != 0 && n_pixels / width != height) return NULL;
+	// Each run is followed by an unchanged pixel, except at row ends:
+	size_t max_runs = (width / 2 + width % 2) * height;
+	size_t size = sizeof(d3d_frame_differ);
+	size_t last_offset, changed_offset, rows_offset, runs_offset;
+	ALIGN_SIZE(size, d3d_pixel);
+	last_offset = size;
+	if (n_pixels * sizeof(d3d_pixel) / sizeof(d3d_pixel) != n_pixels)
+		return NULL;
+	CHECKED_ADD(size, n_pixels * sizeof(d3d_pixel));
+	changed_offset = size;
+	CHECKED_ADD(size, n_pixels);
+	rows_offset = size;
+	CHECKED_ADD(size, height);
+	ALIGN_SIZE(size, d3d_pixel_run_s);
+	runs_offset = size;
+	if (max_runs * sizeof(d3d_pixel_run_s) / sizeof(d3d_pixel_run_s)
+		!= max_runs) return NULL;
+	CHECKED_ADD(size, max_runs * sizeof(d3d_pixel_run_s));
+	alloc = pick_allocator(alloc);
+	d3d_frame_differ *differ = allocate(alloc, size);
+	if (!differ) return NULL;
+	differ->alloc = *alloc;
+	differ->width = width;
+	differ->height = height;
+	differ->primed = 0;
+	// The buffers are glued on after the structure:
+	differ->last = (void *)((char *)differ + last_offset);
+	differ->changed = (unsigned char *)differ + changed_offset;
+	differ->dirty_rows = (unsigned char *)differ + rows_offset;
+	differ->runs = (void *)((char *)differ + runs_offset);
+	memset(differ->changed, 0, n_pixels);
+	memset(differ->dirty_rows, 0, height);
+	return differ;
 }
 
-const d3d_block_s **d3d_board_get(d3d_board *board, size_t x, size_t y)
+// The number of pixels compared at once when looking for changes in a column.
+// Most of a changed column is usually the same, and memcmp is fast at
+// skipping that.
+#define DIFF_BLOCK 16
+
+// Mark the pixels that changed in column x of a camera, and remember the new
+// ones.
+static void diff_column(
+	d3d_frame_differ *differ,
+	const d3d_camera *cam,
+	size_t x)
 {
-	return GET(board, blocks, x, y);
+	size_t width = differ->width, height = differ->height;
+	const d3d_pixel *now = &cam->pixels[x * height];
+	d3d_pixel *last = &differ->last[x * height];
+	if (!memcmp(now, last, height * sizeof(d3d_pixel))) return;
+	for (size_t y = 0; y < height; y += DIFF_BLOCK) {
+		size_t n = height - y < DIFF_BLOCK ? height - y : DIFF_BLOCK;
+		if (!memcmp(now + y, last + y, n * sizeof(d3d_pixel))) continue;
+		for (size_t i = y; i < y + n; ++i) {
+			if (now[i] != last[i]) {
+				differ->changed[i * width + x] = 1;
+				differ->dirty_rows[i] = 1;
+			}
+		}
+	}
+	memcpy(last, now, height * sizeof(d3d_pixel));
 }
 
-void d3d_free_board(d3d_board *board)
+size_t d3d_diff_frame(
+	d3d_frame_differ *differ,
+	const d3d_camera *cam,
+	const d3d_pixel_run_s **runs)
+{
+	size_t width = differ->width, height = differ->height;
+	size_t n_runs = 0;
+	if (cam->width != width || cam->height != height) return (size_t)-1;
+	*runs = differ->runs;
+	if (!differ->primed) {
+		// Everything is new:
+		memcpy(differ->last, cam->pixels,
+			width * height * sizeof(d3d_pixel));
+		differ->primed = 1;
+		if (width == 0) return 0;
+		for (size_t y = 0; y < height; ++y) {
+			d3d_pixel_run_s *run = &differ->runs[n_runs++];
+			run->x = 0;
+			run->y = y;
+			run->len = width;
+		}
+		return n_runs;
+	}
+	for (size_t x = 0; x < width; ++x) {
+		diff_column(differ, cam, x);
+	}
+	// Collect the marks into runs, clearing them for next time:
+	for (size_t y = 0; y < height; ++y) {
+		if (!differ->dirty_rows[y]) continue;
+		differ->dirty_rows[y] = 0;
+		unsigned char *row = &differ->changed[y * width];
+		size_t x = 0;
+		for (;;) {
+			unsigned char *start = memchr(row + x, 1, width - x);
+			if (!start) break;
+			x = start - row;
+			d3d_pixel_run_s *run = &differ->runs[n_runs++];
+			run->x = x;
+			run->y = y;
+			while (x < width && row[x]) row[x++] = 0;
+			run->len = x - run->x;
+		}
+	}
+	return n_runs;
+}
+
+void d3d_free_frame_differ(d3d_frame_differ *differ)
+{
+	if (!differ) return;
+	// The buffers are freed here too:
+	release(&differ->alloc, differ);
+}
+
+// The longest escape sequences written by d3d_ansi_frame. A cursor move has
+// two numbers of at most 20 digits. A colour change is "\x1b[38;5;255m".
+#define ANSI_MOVE_MAX 44
+#define ANSI_COLOR_MAX 11
+
+// Write the decimal digits of n to buf, returning the end.
+static char *put_num(char *buf, size_t n)
+{
+	char digits[20];
+	size_t i = 0;
+	do {
+		digits[i++] = '0' + n % 10;
+		n /= 10;
+	} while (n > 0);
+	while (i--) *buf++ = digits[i];
+	return buf;
+}
+
+// Write the shortest sequence which moves the cursor from column cx of row cy
+// (or from nowhere in particular if cx is (size_t)-1) to column x of row y.
+static char *put_move(char *buf, size_t cx, size_t cy, size_t x, size_t y)
+{
+	if (cx == x && cy == y) return buf;
+	*buf++ = '\x1b';
+	*buf++ = '[';
+	if (cx != (size_t)-1 && cy == y && x > cx) {
+		// Move forward on the same row:
+		if (x - cx > 1) buf = put_num(buf, x - cx);
+		*buf++ = 'C';
+		return buf;
+	}
+	// Move to the absolute position, which is 1-based:
+	if (y > 0) buf = put_num(buf, y + 1);
+	if (x > 0) {
+		*buf++ = ';';
+		buf = put_num(buf, x + 1);
+	}
+	*buf++ = 'H';
+	return buf;
+}
+
+// Write the sequence setting the foreground colour, or the default colour if
+// color is negative.
+static char *put_color(char *buf, short color)
+{
+	*buf++ = '\x1b';
+	*buf++ = '[';
+	if (color < 0) {
+		*buf++ = '3';
+		*buf++ = '9';
+	} else {
+		memcpy(buf, "38;5;", 5);
+		buf = put_num(buf + 5, color % 256);
+	}
+	*buf++ = 'm';
+	return buf;
+}
+
+d3d_ansi *d3d_new_ansi(
+	size_t width,
+	size_t height,
+	size_t n_mapped,
+	const char chars[],
+	const short colors[])
+{
+	return d3d_new_ansi_with(width, height, n_mapped, chars, colors, NULL);
+}
+
+d3d_ansi *d3d_new_ansi_with(
+	size_t width,
+	size_t height,
+	size_t n_mapped,
+	const char chars[],
+	const short colors[],
+	const d3d_allocator_s *alloc)
+{
+	size_t n_pixels = width * height;
+	if (width != 0 && n_pixels / width != height) return NULL;
+	size_t max_runs = (width / 2 + width % 2) * height;
+	size_t size = sizeof(d3d_ansi), colors_offset, chars_offset, buf_offset;
+	size_t buf_size, run_size = ANSI_MOVE_MAX;
+	ALIGN_SIZE(size, short);
+	colors_offset = size;
+	if (colors) {
+		if (n_mapped * sizeof(short) / sizeof(short) != n_mapped)
+			return NULL;
+		CHECKED_ADD(size, n_mapped * sizeof(short));
+	}
+	chars_offset = size;
+	if (chars) CHECKED_ADD(size, n_mapped);
+	buf_offset = size;
+	// Each pixel may need a colour change, and each run a move. Then the
+	// colour is reset:
+	buf_size = ANSI_COLOR_MAX + 1;
+	if (n_pixels * buf_size / buf_size != n_pixels) return NULL;
+	buf_size *= n_pixels;
+	if (max_runs * run_size / run_size != max_runs) return NULL;
+	CHECKED_ADD(buf_size, max_runs * run_size);
+	CHECKED_ADD(buf_size, ANSI_COLOR_MAX);
+	CHECKED_ADD(size, buf_size);
+	alloc = pick_allocator(alloc);
+	d3d_ansi *ansi = allocate(alloc, size);
+	if (!ansi) return NULL;
+	ansi->alloc = *alloc;
+	ansi->differ = d3d_new_frame_differ_with(width, height, alloc);
+	if (!ansi->differ) {
+		release(alloc, ansi);
+		return NULL;
+	}
+	ansi->n_mapped = chars || colors ? n_mapped : 0;
+	ansi->colors = NULL;
+	if (colors) {
+		ansi->colors = (void *)((char *)ansi + colors_offset);
+		memcpy(ansi->colors, colors, n_mapped * sizeof(short));
+	}
+	ansi->chars = NULL;
+	if (chars) {
+		ansi->chars = (char *)ansi + chars_offset;
+		memcpy(ansi->chars, chars, n_mapped);
+	}
+	ansi->buf = (char *)ansi + buf_offset;
+	return ansi;
+}
+
+size_t d3d_ansi_frame(d3d_ansi *ansi, const d3d_camera *cam, const char **text)
+{
+	const d3d_pixel_run_s *runs;
+	size_t n_runs = d3d_diff_frame(ansi->differ, cam, &runs);
+	if (n_runs == (size_t)-1) return n_runs;
+	char *buf = ansi->buf;
+	// The cursor position, which is unknown at first, and the colour,
+	// which is assumed to be the default:
+	size_t cx = -1, cy = -1;
+	short color = -1;
+	for (size_t i = 0; i < n_runs; ++i) {
+		const d3d_pixel_run_s *run = &runs[i];
+		buf = put_move(buf, cx, cy, run->x, run->y);
+		for (size_t x = run->x; x < run->x + run->len; ++x) {
+			d3d_pixel p = *GET(cam, pixels, x, run->y);
+			bool mapped = (size_t)p < ansi->n_mapped;
+			short new_color = mapped && ansi->colors ?
+				ansi->colors[(size_t)p] : -1;
+			if (new_color != color) {
+				buf = put_color(buf, new_color);
+				color = new_color;
+			}
+			*buf++ = mapped && ansi->chars ?
+				ansi->chars[(size_t)p] : (char)p;
+		}
+		cx = run->x + run->len;
+		cy = run->y;
+		// At the right edge, terminals differ in where the cursor is:
+		if (cx >= cam->width) cx = cy = -1;
+	}
+	if (color >= 0) buf = put_color(buf, -1);
+	*text = ansi->buf;
+	return buf - ansi->buf;
+}
+
+void d3d_free_ansi(d3d_ansi *ansi)
 {
-	d3d_free(board);
+	if (!ansi) return;
+	d3d_free_frame_differ(ansi->differ);
+	// The tables and buffer are freed here too:
+	release(&ansi->alloc, ansi);
 }
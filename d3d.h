@@ -2,6 +2,7 @@
 #define D3D_H_
 
 #include <stddef.h>
+#include <stdio.h>
 
 /* COMPILE-TIME OPTIONS
  * --------------------
@@ -12,6 +13,11 @@
  *  - D3D_SCALAR_TYPE: d3d_scalar can be any real type supported by tgmath.h,
  *    but you MUST compile both your code and this library with the same
  *    D3D_SCALAR_TYPE. Scalars are the type double by default.
+ *  - D3D_INTERNAL_SCALAR_TYPE: The real type the library computes with
+ *    internally, which is d3d_scalar by default. Setting it to float while
+ *    d3d_scalar stays double makes drawing faster at some cost in precision.
+ *    You NEED NOT compile your code with the same setting unless you also use
+ *    D3D_USE_INTERNAL_STRUCTS.
  *  - D3D_CUSTOM_ALLOCATOR: Don't use malloc, realloc, and free to implement
  *    d3d_malloc, d3d_realloc, and d3d_free within d3d.c. Instead, the compiled
  *    source code must be linked with custom implementations of those three
@@ -35,6 +41,36 @@ void *d3d_malloc(size_t);
 void *d3d_realloc(void *, size_t);
 void d3d_free(void *);
 
+/* A source of memory for objects of the library, so that different objects can
+ * get memory from different places. alloc, resize, and release work like
+ * malloc, realloc, and free, except that they are passed ctx first, and resize
+ * is also passed the old size of the memory (which is 0 if the memory is
+ * NULL.) release is never passed NULL. An object made with an allocator gets
+ * all its memory from it, and gives it all back to it when freed. */
+typedef struct {
+	void *(*alloc)(void *ctx, size_t size);
+	void *(*resize)(void *ctx, void *mem, size_t old_size, size_t size);
+	void (*release)(void *ctx, void *mem);
+	void *ctx;
+} d3d_allocator_s;
+
+/* An arena, which hands out memory from big blocks and frees it all at once. */
+struct d3d_arena_s;
+typedef struct d3d_arena_s d3d_arena;
+
+/* Allocate a new arena, which gets blocks of at least block_size bytes from
+ * d3d_malloc as needed. NULL is returned if allocation fails. */
+d3d_arena *d3d_new_arena(size_t block_size);
+
+/* Get an allocator which allocates from an arena. Releasing memory to it does
+ * nothing unless the memory is the latest allocated, so objects made with it
+ * need not be freed one by one. */
+d3d_allocator_s d3d_arena_allocator(d3d_arena *arena);
+
+/* Free an arena and all the memory allocated from it. Objects made with it must
+ * not be used or freed afterward. */
+void d3d_free_arena(d3d_arena *arena);
+
 /* A single numeric pixel, for storing whatever data you provide in a
  * texture. */
 #ifdef D3D_PIXEL_TYPE
@@ -100,6 +136,31 @@ typedef enum {
 	D3D_DDOWN
 } d3d_direction;
 
+/* The result of casting a ray across a board with d3d_cast_ray. */
+typedef struct {
+	/* The block which was hit, or NULL if the ray left the board without
+	 * hitting anything. The other members are only meaningful when this is
+	 * not NULL. */
+	const d3d_block_s *block;
+	/* The board coordinates of the block which was hit. */
+	size_t x, y;
+	/* The face of the block which was hit. This is an index into the
+	 * block's faces and is never D3D_DUP or D3D_DDOWN. */
+	d3d_direction face;
+	/* The point where the ray hit the face. */
+	d3d_vec_s pos;
+	/* The distance from the ray's origin to pos. */
+	d3d_scalar dist;
+} d3d_ray_hit_s;
+
+/* A place and direction from which to draw, as passed to d3d_draw. */
+typedef struct {
+	/* The position of the camera on the board. */
+	d3d_vec_s pos;
+	/* The facing angle of the camera in radians. */
+	d3d_scalar facing;
+} d3d_pose_s;
+
 /* Allocate a new camera with given field of view in the x and y directions (in
  * radians) and a given view width and height in pixels. The empty pixel is the
  * pixel value set in the camera when a cast ray hits nothing (it gets off the
@@ -111,12 +172,52 @@ d3d_camera *d3d_new_camera(
 	size_t height,
 	d3d_pixel empty_pixel);
 
+/* This is like d3d_new_camera, but the camera gets memory from alloc. If alloc
+ * is NULL, d3d_malloc and friends are used. The allocator is copied. The
+ * other _with functions below work the same way. */
+d3d_camera *d3d_new_camera_with(
+	d3d_scalar fovx,
+	d3d_scalar fovy,
+	size_t width,
+	size_t height,
+	d3d_pixel empty_pixel,
+	const d3d_allocator_s *alloc);
+
+/* Limit how far a camera can see. Walls, floors and ceilings beyond max_dist
+ * are drawn as fog_pixel, and sprites beyond it are not drawn at all. Rays stop
+ * at the limit, so this bounds the cost of drawing on big open boards. If
+ * max_dist is not positive, there is no limit, which is the default. */
+void d3d_camera_set_view_dist(
+	d3d_camera *cam,
+	d3d_scalar max_dist,
+	d3d_pixel fog_pixel);
+
+/* Shade what a camera draws by distance, using lookup tables. Distances are
+ * divided into n_bands bands, each band_depth deep, with the last one going on
+ * forever. luts holds n_bands tables of lut_size pixels one after another, the
+ * first for the nearest band. A wall, floor, ceiling or sprite pixel p in band
+ * b is drawn as luts[b * lut_size + p] if p is below lut_size, or else as
+ * itself. Empty and fog pixels are not shaded. The tables are copied. If
+ * n_bands or lut_size is 0, shading is turned off, which is the default. -1 is
+ * returned if allocation fails or band_depth is not positive, in which case the
+ * old shading remains. Otherwise, 0 is returned. */
+int d3d_camera_set_shading(
+	d3d_camera *cam,
+	size_t n_bands,
+	d3d_scalar band_depth,
+	size_t lut_size,
+	const d3d_pixel luts[]);
+
 /* Get the view width of a camera in pixels. */
 size_t d3d_camera_width(const d3d_camera *cam);
 
 /* Get the view height of a camera in pixels. */
 size_t d3d_camera_height(const d3d_camera *cam);
 
+/* Get the number of sprites which were in the field of view of a camera when
+ * it last drew a frame. Some of them may have been hidden behind walls. */
+size_t d3d_camera_sprites_drawn(const d3d_camera *cam);
+
 /* Get a pixel in the camera's view. This returns NULL if the coordinates are
  * out of range. Otherwise, the pointer is valid until another function takes
  * the camera as a non-const parameter. If d3d_draw hasn't yet been called with
@@ -132,6 +233,14 @@ void d3d_free_camera(d3d_camera *cam);
  * are 0, as a dimension of 0 cannot be stretched across another dimension. */
 d3d_texture *d3d_new_texture(size_t width, size_t height, d3d_pixel fill);
 
+/* This is like d3d_new_texture, but with an allocator. Any mipmaps come from
+ * the allocator too. */
+d3d_texture *d3d_new_texture_with(
+	size_t width,
+	size_t height,
+	d3d_pixel fill,
+	const d3d_allocator_s *alloc);
+
 /* Get the width of the texture in pixels. */
 size_t d3d_texture_width(const d3d_texture *txtr);
 
@@ -143,14 +252,154 @@ size_t d3d_texture_height(const d3d_texture *txtr);
  * in d3d_draw. This function does not modify the texture in any way. */
 d3d_pixel *d3d_texture_get(d3d_texture *txtr, size_t x, size_t y);
 
+/* Build a mipmap chain for a texture: a series of smaller and smaller versions
+ * of it, each half the size of the last (rounded up) down to 1 by 1. When a
+ * texture has a chain, d3d_draw uses a smaller version for walls and floors
+ * which are far away, which looks less noisy and is faster. Since pixels can
+ * mean anything, it's up to the reduce function to combine each square of 4
+ * pixels into one. The pixels in the square are (x, y), (x + 1, y), (x, y + 1),
+ * and (x + 1, y + 1) in that order, with pixels repeated at odd edges. ctx is
+ * passed to reduce unchanged. Building again replaces the old chain, which must
+ * be done after modifying the texture's pixels for the change to show from far
+ * away. The chain is freed along with the texture. 0 is returned on success and
+ * -1 is returned if allocation fails, in which case the texture is left without
+ * a chain. */
+int d3d_texture_build_mips(
+	d3d_texture *txtr,
+	d3d_pixel (*reduce)(void *ctx, const d3d_pixel square[4]),
+	void *ctx);
+
 /* Permanently destroy a texture. */
 void d3d_free_texture(d3d_texture *txtr);
 
+/* A group of textures all stored together in a single allocation. */
+struct d3d_texture_atlas_s;
+typedef struct d3d_texture_atlas_s d3d_texture_atlas;
+
+/* Allocate n_textures textures together in one allocation, with their pixels
+ * initialized to the fill pixel. The ith texture has the dimensions widths[i]
+ * and heights[i], with 0 made into 1 as with d3d_new_texture. Keeping the
+ * textures of a scene together like this makes drawing it friendlier to the
+ * cache. The pixels of each texture start on a 64-byte boundary. NULL is
+ * returned if allocation fails. */
+d3d_texture_atlas *d3d_new_texture_atlas(
+	size_t n_textures,
+	const size_t widths[],
+	const size_t heights[],
+	d3d_pixel fill);
+
+/* This is like d3d_new_texture_atlas, but with an allocator. */
+d3d_texture_atlas *d3d_new_texture_atlas_with(
+	size_t n_textures,
+	const size_t widths[],
+	const size_t heights[],
+	d3d_pixel fill,
+	const d3d_allocator_s *alloc);
+
+/* Get the number of textures in an atlas. */
+size_t d3d_atlas_n_textures(const d3d_texture_atlas *atlas);
+
+/* Get the texture at an index in an atlas, or NULL if the index is out of
+ * range. The pointer is the same each time and is valid until the atlas is
+ * freed. It can be used like any other texture, except that it must not be
+ * freed with d3d_free_texture. */
+d3d_texture *d3d_atlas_texture(d3d_texture_atlas *atlas, size_t i);
+
+/* Destroy an atlas and all its textures at once. */
+void d3d_free_texture_atlas(d3d_texture_atlas *atlas);
+
 /* Create a new board with a width and height. All its blocks are initially
  * set to the block fill. If fill is NULL, all the blocks are set to an
  * empty/transparent block. NULL is returned if allocation fails. */
 d3d_board *d3d_new_board(size_t width, size_t height, const d3d_block_s *fill);
 
+/* This is like d3d_new_board, but with an allocator. Any acceleration data
+ * comes from the allocator too. */
+d3d_board *d3d_new_board_with(
+	size_t width,
+	size_t height,
+	const d3d_block_s *fill,
+	const d3d_allocator_s *alloc);
+
+/* Create a new board which stores its blocks as 8- or 16-bit indices into a
+ * palette of blocks instead of as pointers. This saves a lot of memory with
+ * large boards. The palette is copied from the n_blocks pointers in blocks,
+ * where NULL pointers stand for empty/transparent blocks. There must be
+ * between 1 and 65536 blocks, and the board can have only those blocks. All the
+ * board's blocks are initially blocks[0]. NULL is returned if allocation fails
+ * or there are too many or too few blocks. Palette boards are drawn just like
+ * other boards, but their blocks must be set with d3d_board_set instead of
+ * d3d_board_get. */
+d3d_board *d3d_new_palette_board(
+	size_t width,
+	size_t height,
+	size_t n_blocks,
+	const d3d_block_s *const blocks[]);
+
+/* This is like d3d_new_palette_board, but with an allocator. */
+d3d_board *d3d_new_palette_board_with(
+	size_t width,
+	size_t height,
+	size_t n_blocks,
+	const d3d_block_s *const blocks[],
+	const d3d_allocator_s *alloc);
+
+/* The width and height in blocks of the chunks of a chunked board. */
+#define D3D_CHUNK_SIZE 32
+
+/* Where a chunked board gets its blocks from. See d3d_new_chunked_board. */
+typedef struct {
+	/* Fill in the blocks of the chunk with chunk coordinates (cx, cy). The
+	 * chunk covers the board coordinates from (cx * D3D_CHUNK_SIZE,
+	 * cy * D3D_CHUNK_SIZE) inclusive to ((cx + 1) * D3D_CHUNK_SIZE,
+	 * (cy + 1) * D3D_CHUNK_SIZE) exclusive. The block at (x, y) within the
+	 * chunk is blocks[y + D3D_CHUNK_SIZE * x]. All the blocks start out as
+	 * the board's fill block. Return 0 if the chunk was left entirely fill
+	 * so that one shared copy can be used, or nonzero otherwise. If this is
+	 * NULL, the board is entirely fill until it is changed. */
+	int (*load)(void *ctx, size_t cx, size_t cy,
+		const d3d_block_s *blocks[]);
+	/* Called with the blocks of a chunk right before it is evicted or the
+	 * board is freed, for example to save changes. Chunks for which load
+	 * returned 0 and which were never changed are not passed here. This
+	 * can be NULL. */
+	void (*unload)(void *ctx, size_t cx, size_t cy,
+		const d3d_block_s *const blocks[]);
+	/* The first argument to the functions above. */
+	void *ctx;
+} d3d_chunk_source_s;
+
+/* Create a new board whose blocks are loaded from a source in chunks of
+ * D3D_CHUNK_SIZE by D3D_CHUNK_SIZE blocks when they are first looked at. The
+ * board can be much larger than memory would allow otherwise. At most
+ * max_chunks chunks (at least 1) are loaded at once; beyond that, the least
+ * recently used chunk is evicted, to be loaded again later if needed. Each
+ * loaded chunk takes up D3D_CHUNK_SIZE * D3D_CHUNK_SIZE block pointers, except
+ * for chunks that are entirely fill, which share a single copy. If fill is
+ * NULL, it is an empty/transparent block. The source is copied, and may be
+ * NULL to make an empty board. NULL is returned if allocation fails.
+ *
+ * Any use of a chunked board can load chunks, so unlike other boards, chunked
+ * boards must not be used from multiple threads at once, even through const
+ * pointers. Pointers from d3d_board_get for chunked boards are only valid
+ * until the board is next used. Chunked boards cannot be accelerated. */
+d3d_board *d3d_new_chunked_board(
+	size_t width,
+	size_t height,
+	const d3d_block_s *fill,
+	const d3d_chunk_source_s *source,
+	size_t max_chunks);
+
+/* This is like d3d_new_chunked_board, but with an allocator. The chunks come
+ * from the allocator too. */
+d3d_board *d3d_new_chunked_board_with(
+	size_t width,
+	size_t height,
+	const d3d_block_s *fill,
+	const d3d_chunk_source_s *source,
+	size_t max_chunks,
+	const d3d_allocator_s *alloc);
+
 /* Get the width of the board in blocks. */
 size_t d3d_board_width(const d3d_board *board);
 
@@ -161,12 +410,108 @@ size_t d3d_board_height(const d3d_board *board);
  * returned. Otherwise, a pointer to a block POINTER is returned. This pointed-
  * to pointer can be modified with a new block pointer. The outer pointer is
  * valid until the board is used in d3d_draw. This function does not modify the
- * board in any way. */
+ * board in any way. NULL is always returned for palette boards, which don't
+ * store block pointers. */
 const d3d_block_s **d3d_board_get(d3d_board *board, size_t x, size_t y);
 
+/* Get the block at a position on a board of any kind. NULL is returned if the
+ * coordinates are out of range. This function does not modify the board in
+ * any way. */
+const d3d_block_s *d3d_board_block(const d3d_board *board, size_t x, size_t y);
+
+/* Set the block at a position on a board of any kind. A NULL block means an
+ * empty/transparent block. This calls d3d_board_changed for you. -1 is returned
+ * if the coordinates are out of range or if the board is a palette board and
+ * the block is not in its palette, in which case nothing changes. Otherwise, 0
+ * is returned. Finding a block in a palette takes time proportional to the
+ * size of the palette. */
+int d3d_board_set(
+	d3d_board *board,
+	size_t x,
+	size_t y,
+	const d3d_block_s *block);
+
+/* Build an optional acceleration structure for a board so that rays can cross
+ * large empty areas in a few steps and find walls without looking at blocks
+ * until one is hit. This takes two bytes per block. Calling this
+ * again rebuilds the structure from scratch. 0 is returned on success and -1 is
+ * returned if allocation fails, in which case the board remains usable without
+ * acceleration. The structure is freed along with the board. */
+int d3d_board_accelerate(d3d_board *board);
+
+/* Tell an accelerated board that the block at the given coordinates has been
+ * replaced through d3d_board_get. This MUST be done after each such change,
+ * or else rays may pass through the new block. Changes to the faces of a
+ * block already on the board need this call for each position where it is.
+ * Nothing happens if the board is not accelerated or the coordinates are out
+ * of range. Removing walls this way is cheap but can leave the board less
+ * accelerated than d3d_board_accelerate would make it. */
+void d3d_board_changed(d3d_board *board, size_t x, size_t y);
+
 /* Permanently destroy a board. */
 void d3d_free_board(d3d_board *board);
 
+/* Potentially visible sets (PVSs) for the cells of a board, or for some of
+ * them. A PVS for a cell lists the cells which can be seen from somewhere in
+ * that cell, stored as runs of cells in the column-major order of boards. */
+struct d3d_pvs_s;
+typedef struct d3d_pvs_s d3d_pvs;
+
+/* Compute the PVSs of the cells in the board columns first, first + step,
+ * first + 2 * step, and so on below the board width. Visibility is found by
+ * casting n_rays rays in evenly spaced directions from each of several points
+ * in each cell, so a sliver of a cell seen only through a gap narrower than
+ * the spacing of the rays may be missed. A few hundred rays are usually
+ * enough for maze-like boards. The time taken grows with the number of rays
+ * and with how far the rays go. NULL is returned if allocation fails, if the
+ * board has more than 4294967295 cells, or if the board is chunked.
+ *
+ * Since the board is not modified, the columns can be split among threads that
+ * each call this function with the same board, with first being the thread
+ * number and step being the number of threads. A step of 0 is treated as 1.
+ * The results are then combined by d3d_board_use_pvs. */
+d3d_pvs *d3d_new_pvs(
+	const d3d_board *board,
+	size_t n_rays,
+	size_t first,
+	size_t step);
+
+/* This is like d3d_new_pvs, but with an allocator. */
+d3d_pvs *d3d_new_pvs_with(
+	const d3d_board *board,
+	size_t n_rays,
+	size_t first,
+	size_t step,
+	const d3d_allocator_s *alloc);
+
+/* Store PVSs from n_parts results of d3d_new_pvs for the board with the board,
+ * replacing any stored before. The parts are copied into one compact table and
+ * can then be freed. Cells not covered by any part can see everything. When a
+ * board has PVSs, d3d_draw skips sprites which cannot be seen from the cell of
+ * the camera before sorting them. PVSs are not updated when blocks change, so
+ * they are meant for static geometry; if walls are removed, update the PVSs or
+ * remove them by passing 0 for n_parts. -1 is returned if allocation fails or
+ * a part was computed for a board of a different size, in which case nothing
+ * changes. Otherwise, 0 is returned. */
+int d3d_board_use_pvs(
+	d3d_board *board,
+	size_t n_parts,
+	const d3d_pvs *const parts[]);
+
+/* Check whether the cell (to_x, to_y) may be visible from the cell (from_x,
+ * from_y) according to the PVSs of a board. If the board has no PVSs, 1 is
+ * always returned. 0 is returned if either cell is out of range. Finding the
+ * answer takes time proportional to the logarithm of the size of the PVS. */
+int d3d_board_sees(
+	const d3d_board *board,
+	size_t from_x,
+	size_t from_y,
+	size_t to_x,
+	size_t to_y);
+
+/* Destroy PVSs made by d3d_new_pvs. */
+void d3d_free_pvs(d3d_pvs *pvs);
+
 /* Record what the camera sees, making it valid to access camera pixels. This
  * function is the entire point of this library.
  *
@@ -191,35 +536,436 @@ void d3d_draw(
 	size_t n_sprites,
 	const d3d_sprite_s sprites[]);
 
+/* A set of sprites sorted into buckets by where they are on a board, so that
+ * d3d_draw_indexed only needs to look at sprites which might be in view. Each
+ * sprite in an index has an ID, which stays the same until it is removed. */
+struct d3d_sprite_index_s;
+typedef struct d3d_sprite_index_s d3d_sprite_index;
+
+/* Make an empty sprite index for a board of the given width and height. Each
+ * bucket covers bucket_size by bucket_size blocks. Smaller buckets let more
+ * sprites be skipped but take longer to go through. A bucket_size of 0 is
+ * treated as 1. NULL is returned if allocation fails. */
+d3d_sprite_index *d3d_new_sprite_index(
+	size_t width,
+	size_t height,
+	size_t bucket_size);
+
+/* This is like d3d_new_sprite_index, but with an allocator. */
+d3d_sprite_index *d3d_new_sprite_index_with(
+	size_t width,
+	size_t height,
+	size_t bucket_size,
+	const d3d_allocator_s *alloc);
+
+/* Add a copy of a sprite to an index and return its ID. IDs of removed sprites
+ * may be reused. (size_t)-1 is returned if allocation fails. */
+size_t d3d_sprite_index_add(
+	d3d_sprite_index *index,
+	const d3d_sprite_s *sprite);
+
+/* Replace the sprite with the given ID by a copy of another sprite, moving it
+ * to a different bucket if needed. -1 is returned if no sprite has the ID.
+ * Otherwise, 0 is returned. */
+int d3d_sprite_index_set(
+	d3d_sprite_index *index,
+	size_t id,
+	const d3d_sprite_s *sprite);
+
+/* Move the sprite with the given ID to pos. This is like d3d_sprite_index_set,
+ * but only changes the position, which takes constant time. */
+int d3d_sprite_index_move(
+	d3d_sprite_index *index,
+	size_t id,
+	d3d_vec_s pos);
+
+/* Get the sprite with the given ID, or NULL if no sprite has it. The pointer
+ * is valid until the index is next modified. Change the sprite with
+ * d3d_sprite_index_set, not through the pointer. */
+const d3d_sprite_s *d3d_sprite_index_get(
+	const d3d_sprite_index *index,
+	size_t id);
+
+/* Remove the sprite with the given ID. -1 is returned if no sprite has it.
+ * Otherwise, 0 is returned. */
+int d3d_sprite_index_remove(d3d_sprite_index *index, size_t id);
+
+/* Get the number of sprites in an index. */
+size_t d3d_sprite_index_count(const d3d_sprite_index *index);
+
+/* Destroy a sprite index. */
+void d3d_free_sprite_index(d3d_sprite_index *index);
+
+/* This is like d3d_draw, but the sprites come from an index. Only buckets which
+ * overlap the field of view of the camera, and are within its view distance if
+ * it has one, are looked at. When a camera draws the same index as in its last
+ * frame, the sprites seen then are sorted from their old order, which is
+ * quick if they have not moved much, and only sprites newly in view are sorted
+ * from scratch. Drawing keeps track of which sprites it has looked at in the
+ * index, so an index must not be drawn from two threads at once. Sprites
+ * outside the index or board are not drawn. */
+void d3d_draw_indexed(
+	d3d_camera *cam,
+	d3d_vec_s cam_pos,
+	d3d_scalar cam_facing,
+	const d3d_board *board,
+	d3d_sprite_index *index);
+
+/* Draw a board without sprites from a sequence of poses. The poses at indices
+ * first, first + step, first + 2 * step, and so on below n_poses are drawn in
+ * that order with the camera. After each is drawn, emit is called with ctx,
+ * the index of the pose, and the camera, whose pixels hold the frame. If emit
+ * returns nonzero, drawing stops. The number of frames drawn is returned. A
+ * step of 0 is treated as 1.
+ *
+ * This is meant for rendering many views offline. Since the board is not
+ * modified, the poses can be split among threads that each call this function
+ * with their own camera, with first being the thread number and step being the
+ * number of threads. (This does not apply to chunked boards.) */
+size_t d3d_render_batch(
+	d3d_camera *cam,
+	const d3d_board *board,
+	size_t n_poses,
+	const d3d_pose_s poses[],
+	size_t first,
+	size_t step,
+	int (*emit)(void *ctx, size_t index, d3d_camera *cam),
+	void *ctx);
+
+/* Cast a ray from the point origin on the board in the direction angle, which
+ * is measured the same way as the cam_facing argument of d3d_draw. The rules
+ * for which faces stop the ray are exactly those used by d3d_draw, so a block
+ * hit here is the one d3d_draw would show in that direction. The result is
+ * stored in hit, and hit->block is also returned. NULL is returned if the ray
+ * leaves the board or origin is not inside the board. */
+const d3d_block_s *d3d_cast_ray(
+	const d3d_board *board,
+	d3d_vec_s origin,
+	d3d_scalar angle,
+	d3d_ray_hit_s *hit);
+
+/* Cast n_rays rays on a board. The ith ray is cast from origins[i] at the angle
+ * angles[i] and its result is put in hits[i], just as if d3d_cast_ray had been
+ * called for each. This function does not modify the board, so a large batch
+ * can be split into slices cast from different threads at once. */
+void d3d_cast_rays(
+	const d3d_board *board,
+	size_t n_rays,
+	const d3d_vec_s origins[],
+	const d3d_scalar angles[],
+	d3d_ray_hit_s hits[]);
+
+/* A level loaded from level data made by d3d_save_level. It consists of a
+ * list of textures and a board. */
+struct d3d_level_s;
+typedef struct d3d_level_s d3d_level;
+
+/* Write a level to a file in a binary format that d3d_load_level can use in
+ * place. The level consists of the board and the n_textures textures, which
+ * must include all those on the faces of the board's blocks. The format is
+ * versioned and uses the native byte order and sizes, so it is only meant to be
+ * loaded by a build of this library using the same D3D_PIXEL_TYPE on the same
+ * kind of machine. Saving a board with more than 65536 distinct blocks is
+ * unsupported. -1 is returned if the level cannot be saved or an error occurs
+ * writing the file. Otherwise, 0 is returned. */
+int d3d_save_level(
+	FILE *file,
+	const d3d_board *board,
+	size_t n_textures,
+	const d3d_texture *const textures[]);
+
+/* Load a level from size bytes of data written by d3d_save_level. The data is
+ * used in place; only the table of blocks is copied, so loading takes time
+ * proportional to the number of distinct textures and blocks, not pixels or
+ * board size. The data would usually be a file mapped into memory with mmap.
+ * It must stay at the same place until the level is freed, and must be
+ * aligned as malloc would align it (mappings are.) The sizes and offsets in the
+ * data are all checked, and NULL is returned if any are invalid or if
+ * allocation fails. Blocks of the board whose indices are past the end of the
+ * table of blocks are empty. Modifying the level's textures or board modifies
+ * the data, so don't do so if it is mapped read-only. */
+d3d_level *d3d_load_level(void *data, size_t size);
+
+/* This is like d3d_load_level, but with an allocator. */
+d3d_level *d3d_load_level_with(
+	void *data,
+	size_t size,
+	const d3d_allocator_s *alloc);
+
+/* Get the number of textures in a level. */
+size_t d3d_level_n_textures(const d3d_level *level);
+
+/* Get a texture in a level by its index in the list passed to d3d_save_level.
+ * NULL is returned if the index is out of range. The texture is owned by the
+ * level and must not be freed separately. */
+d3d_texture *d3d_level_texture(d3d_level *level, size_t i);
+
+/* Get the board of a level. It is a palette board whose palette is the level's
+ * distinct blocks. The board is owned by the level and must not be freed
+ * separately. */
+d3d_board *d3d_level_board(d3d_level *level);
+
+/* Destroy a level and everything it owns. The data it was loaded from is not
+ * freed. */
+void d3d_free_level(d3d_level *level);
+
+/* A recorder of d3d_draw calls and board changes, for replaying them later with
+ * d3d_replay. Captures are written to a FILE. */
+struct d3d_capture_s;
+typedef struct d3d_capture_s d3d_capture;
+
+/* Start a capture written to file. The board and textures are saved first, as
+ * with d3d_save_level. Every texture used by sprites in captured frames must be
+ * in the list. Nothing else is written until something is captured. NULL is
+ * returned if allocation or writing fails. The file is not closed when the
+ * capture is freed.
+ *
+ * Textures are captured as they are now; later changes to their pixels and any
+ * mipmaps are not captured, so replayed frames using them may not match. */
+d3d_capture *d3d_new_capture(
+	FILE *file,
+	const d3d_board *board,
+	size_t n_textures,
+	const d3d_texture *const textures[]);
+
+/* This is like d3d_new_capture, but with an allocator. */
+d3d_capture *d3d_new_capture_with(
+	FILE *file,
+	const d3d_board *board,
+	size_t n_textures,
+	const d3d_texture *const textures[],
+	const d3d_allocator_s *alloc);
+
+/* Call d3d_draw with the arguments and record the call, along with the camera
+ * settings if they changed since the last captured frame and a hash of the
+ * drawn pixels. The frame is always drawn. -1 is returned if a sprite texture
+ * is not one of those given to d3d_new_capture or if writing fails. Otherwise,
+ * 0 is returned. */
+int d3d_capture_draw(
+	d3d_capture *cap,
+	d3d_camera *cam,
+	d3d_vec_s cam_pos,
+	d3d_scalar cam_facing,
+	const d3d_board *board,
+	size_t n_sprites,
+	const d3d_sprite_s sprites[]);
+
+/* Call d3d_board_set with the arguments and record the change. A replay can
+ * only make the change if a block with the same faces was on the board when
+ * the capture started, so keep all such blocks somewhere on the board. -1 is
+ * returned if d3d_board_set fails, if a face is not one of the textures given
+ * to d3d_new_capture, or if writing fails. Otherwise, 0 is returned. */
+int d3d_capture_set_block(
+	d3d_capture *cap,
+	d3d_board *board,
+	size_t x,
+	size_t y,
+	const d3d_block_s *block);
+
+/* Stop capturing. The file is not flushed or closed. */
+void d3d_free_capture(d3d_capture *cap);
+
+/* A player of captures written through d3d_capture. */
+struct d3d_replay_s;
+typedef struct d3d_replay_s d3d_replay;
+
+/* Load size bytes of capture data to be replayed. Like with d3d_load_level, the
+ * data is used in place and would usually be mapped with mmap, but since block
+ * changes are replayed onto the captured board, the mapping must be writable
+ * (MAP_PRIVATE works.) The data must stay at the same place until the replay
+ * is freed. NULL is returned if the data are invalid or if allocation fails. */
+d3d_replay *d3d_load_replay(void *data, size_t size);
+
+/* This is like d3d_load_replay, but with an allocator. */
+d3d_replay *d3d_load_replay_with(
+	void *data,
+	size_t size,
+	const d3d_allocator_s *alloc);
+
+/* Go to the next captured frame, making any captured camera and board changes
+ * on the way. 1 is returned if there is a frame, which d3d_replay_draw will
+ * draw. 0 is returned at the end of the capture. -1 is returned if the data are
+ * invalid, a block change cannot be made, or allocation fails. */
+int d3d_replay_next(d3d_replay *rp);
+
+/* Draw the current frame with d3d_draw, just as it was captured. This does
+ * nothing else, so it can be timed by itself. */
+void d3d_replay_draw(d3d_replay *rp);
+
+/* Check whether the pixels of the replay camera match the captured hash of the
+ * current frame. 1 is returned if they do, and 0 if not. */
+int d3d_replay_check(const d3d_replay *rp);
+
+/* Get the camera drawn into by a replay. This is NULL before the first frame.
+ * The camera is owned by the replay and may be replaced by d3d_replay_next. */
+d3d_camera *d3d_replay_camera(d3d_replay *rp);
+
+/* Get the captured board of a replay, with changes made up to the current
+ * frame. The board is owned by the replay. */
+d3d_board *d3d_replay_board(d3d_replay *rp);
+
+/* Destroy a replay. The data it was loaded from is not freed. */
+void d3d_free_replay(d3d_replay *rp);
+
+/* A row of changed pixels found by d3d_diff_frame. The run starts at (x, y) and
+ * continues len pixels in the +x direction. */
+typedef struct {
+	size_t x, y, len;
+} d3d_pixel_run_s;
+
+/* An object remembering the last frame of a camera, so that the next frame can
+ * be compared with it. This is useful for only sending what changed to a
+ * terminal or over a network. */
+struct d3d_frame_differ_s;
+typedef struct d3d_frame_differ_s d3d_frame_differ;
+
+/* Allocate a new frame differ for cameras of the given width and height. NULL
+ * is returned if allocation fails. */
+d3d_frame_differ *d3d_new_frame_differ(size_t width, size_t height);
+
+/* This is like d3d_new_frame_differ, but with an allocator. */
+d3d_frame_differ *d3d_new_frame_differ_with(
+	size_t width,
+	size_t height,
+	const d3d_allocator_s *alloc);
+
+/* Compare the pixels of a camera with those passed in the last call, and then
+ * remember the new ones. The runs of changed pixels are put in an array owned
+ * by the differ, to which *runs is set. The runs are ordered by row, then by
+ * column, and are valid until the differ is used again. The number of runs is
+ * returned. The first call reports every pixel as changed. If the camera is not
+ * the size the differ was made for, nothing is done and (size_t)-1 is
+ * returned. */
+size_t d3d_diff_frame(
+	d3d_frame_differ *differ,
+	const d3d_camera *cam,
+	const d3d_pixel_run_s **runs);
+
+/* Destroy a frame differ. */
+void d3d_free_frame_differ(d3d_frame_differ *differ);
+
+/* An object turning camera frames into text for an ANSI terminal. Only the
+ * pixels which changed since the last frame are written. */
+struct d3d_ansi_s;
+typedef struct d3d_ansi_s d3d_ansi;
+
+/* Allocate a new ANSI renderer for cameras of the given width and height. The
+ * first n_mapped pixel values can be mapped to characters and colours by the
+ * tables chars and colors, each of which may be NULL. A colour is an index into
+ * the 256-colour palette, or -1 for the default. Pixels which are not mapped
+ * are written as the characters of the same value in the default colour. The
+ * tables are copied. NULL is returned if allocation fails. */
+d3d_ansi *d3d_new_ansi(
+	size_t width,
+	size_t height,
+	size_t n_mapped,
+	const char chars[],
+	const short colors[]);
+
+/* This is like d3d_new_ansi, but with an allocator. */
+d3d_ansi *d3d_new_ansi_with(
+	size_t width,
+	size_t height,
+	size_t n_mapped,
+	const char chars[],
+	const short colors[],
+	const d3d_allocator_s *alloc);
+
+/* Write the escape sequences and characters which update a terminal from the
+ * last frame to the camera's current one into a buffer owned by the renderer,
+ * setting *text to the buffer. The number of bytes is returned, and the text is
+ * valid until the renderer is used again. It is meant to be written with one
+ * call to write or fwrite, to a terminal, pty or file. The first frame is
+ * written in full. Cursor moves are made as short as possible, and the colour
+ * is reset at the end. If the camera is not the size the renderer was made
+ * for, nothing is done and (size_t)-1 is returned. */
+size_t d3d_ansi_frame(d3d_ansi *ansi, const d3d_camera *cam, const char **text);
+
+/* Destroy an ANSI renderer. */
+void d3d_free_ansi(d3d_ansi *ansi);
+
 #endif /* D3D_H_ */
 
 /* Complete structure definitions. */
 #if defined(D3D_USE_INTERNAL_STRUCTS) && !defined(D3D_INTERNAL_H_)
 #define D3D_INTERNAL_H_
 
+#include <stdint.h>
+
+// The scalar type used inside the library (see D3D_INTERNAL_SCALAR_TYPE.)
+#ifdef D3D_INTERNAL_SCALAR_TYPE
+typedef D3D_INTERNAL_SCALAR_TYPE d3d_internal_scalar;
+#else
+typedef d3d_scalar d3d_internal_scalar;
+#endif
+
+// A vector of internal scalars.
+typedef struct {
+	d3d_internal_scalar x, y;
+} d3d_internal_vec_s;
+
 struct d3d_texture_s {
+	// Where mipmaps, and the texture itself if it is not part of something
+	// else, come from.
+	d3d_allocator_s alloc;
 	// Width and height in pixels.
 	size_t width, height;
-	// Column-major pixels.
-	d3d_pixel pixels[];
+	// Column-major pixels. These are usually glued on after the structure
+	// in the same allocation.
+	d3d_pixel *pixels;
+	// The smaller levels of the mipmap chain, in order of decreasing size,
+	// or NULL if there is no chain. The levels are a single allocation.
+	// They have no chains of their own.
+	struct d3d_texture_s *mips;
+	// The number of items in 'mips'.
+	size_t n_mips;
+	// About log2 of the larger dimension, if there are mipmaps.
+	int size_log2;
+	// Nonzero if the width and height are both powers of two. Then the
+	// masks are the dimensions minus 1 and hshift is log2(height.)
+	unsigned char pow2;
+	size_t wmask, hmask;
+	unsigned hshift;
 };
 
 // This is for drawing multiple sprites.
 struct d3d_sprite_order {
 	// The distance from the camera
-	d3d_scalar dist;
+	d3d_internal_scalar dist;
 	// The corresponding index into the given d3d_sprite_s list
 	size_t index;
 };
 
 struct d3d_camera_s {
+	// Where the memory of the camera comes from.
+	d3d_allocator_s alloc;
 	// The field of view in the x (sideways) and y (vertical) screen axes.
 	// Measured in radians.
-	d3d_vec_s fov;
+	d3d_internal_vec_s fov;
 	// The width and height of the camera screen, in pixels.
 	size_t width, height;
+	// The angle in radians between neighbouring pixels, horizontally or
+	// vertically, whichever is larger. This is used to pick mipmap levels.
+	d3d_internal_scalar lod_scale;
 	// The block containing all empty textures.
 	d3d_block_s blank_block;
+	// The view distance, which is infinite if there is no limit.
+	d3d_internal_scalar max_dist;
+	// Floors and ceilings are beyond the view distance in rows whose tans
+	// have absolute values below this.
+	d3d_internal_scalar fog_tan;
+	// A 1 by 1 texture of the fog pixel.
+	d3d_texture *fog;
+	// The number of shading bands, or 0 if there is no shading, and the
+	// sizes of the bands and of their tables.
+	size_t n_bands, lut_size;
+	d3d_internal_scalar band_depth;
+	// The shading tables, one after another. This is glued on after
+	// row_luts in the same allocation.
+	d3d_pixel *luts;
+	// For each row of the screen, the table used for floors and ceilings in
+	// that row. This is NULL if there is no shading.
+	const d3d_pixel **row_luts;
 	// The last buffer used when sorting sprites, or NULL the first time.
 	struct d3d_sprite_order *order;
 	// The capacity (allocation size) of the field above.
@@ -228,24 +974,264 @@ struct d3d_camera_s {
 	const d3d_sprite_s *last_sprites;
 	// The number of sprites last drawn.
 	size_t last_n_sprites;
+	// The sprite index last drawn, in which case order holds sprite IDs
+	// and last_sprites is NULL. Otherwise, this is NULL.
+	const struct d3d_sprite_index_s *last_index;
+	// The number of sprites in the field of view in the last frame.
+	size_t n_sprites_drawn;
 	// For each row of the screen, the tangent of the angle of that row
 	// relative to the center of the screen, in radians
 	// For example, the 0th item is tan(fov.y / 2)
-	d3d_scalar *tans;
+	d3d_internal_scalar *tans;
 	// For each column of the screen, the distance from the camera to the
 	// first wall in that direction. This is calculated when drawing columns
 	// and is used when drawing sprites.
-	d3d_scalar *dists;
+	d3d_internal_scalar *dists;
+	// For each row of the screen, the level of detail for picking the
+	// mipmap levels of floors and ceilings seen in that row.
+	int *row_lods;
 	// The pixels of the screen in column-major order.
 	d3d_pixel pixels[];
 };
 
+// A chunk loaded on a chunked board.
+struct d3d_chunk_entry {
+	// The chunk coordinates.
+	size_t cx, cy;
+	// The blocks of the chunk. This may be the shared fill chunk.
+	const d3d_block_s **blocks;
+	// The neighbouring entries in the LRU list, or (size_t)-1 at the ends.
+	size_t prev, next;
+};
+
+// The chunks loaded on a chunked board.
+struct d3d_chunk_cache {
+	// Where the chunks come from.
+	d3d_chunk_source_s source;
+	// The maximum and current numbers of loaded chunks.
+	size_t max_chunks, n_chunks;
+	// The first n_chunks of these are loaded. This has max_chunks items.
+	struct d3d_chunk_entry *entries;
+	// An open addressing hash table of indices into entries, with the
+	// empty slots being (size_t)-1. table_cap is a power of 2.
+	size_t *table;
+	size_t table_cap;
+	// The most and least recently used entries.
+	size_t lru_head, lru_tail;
+	// Where the chunks come from. This is the allocator of the board.
+	const d3d_allocator_s *alloc;
+	// The chunk shared by all chunks that are entirely fill.
+	const d3d_block_s **fill_chunk;
+	// An unused chunk allocation kept for the next load, or NULL.
+	const d3d_block_s **spare;
+	// The blocks of the chunk last looked at, and its chunk coordinates.
+	// This is NULL if no chunk is remembered.
+	const d3d_block_s **last;
+	size_t last_cx, last_cy;
+};
+
 struct d3d_board_s {
+	// Where the memory of the board comes from.
+	d3d_allocator_s alloc;
 	// The width and height of the board, in blocks
 	size_t width, height;
+	// If the board was accelerated, this holds a value for each block in
+	// the same layout as 'blocks'. The low 6 bits are set for the faces the
+	// block has, by d3d_direction. The high 8 bits are at most the distance
+	// in blocks, counting diagonals as 1, to the nearest block with a
+	// vertical face or off the board. It is NULL if the board is not
+	// accelerated.
+	unsigned short *accel;
+	// 0 if the blocks are stored as pointers in 'blocks'. Otherwise, the size
+	// in bytes (1 or 2) of each of the palette indices in 'indices'.
+	unsigned char index_size;
+	// The number of blocks in the palette, if there is one.
+	size_t n_palette;
+	// For palette boards, the indices into 'blocks' of each block on the
+	// board, in the layout 'blocks' otherwise has. Otherwise, NULL.
+	void *indices;
+	// For chunked boards, the chunks that are loaded. Otherwise, NULL.
+	struct d3d_chunk_cache *chunks;
+	// For accelerated boards, the numbers of blocks with D3D_DUP and
+	// D3D_DDOWN faces respectively.
+	size_t n_ceilings, n_floors;
+	// If the board has PVSs, this holds width * height + 1 offsets into
+	// pvs_runs, so that the PVS of the block at index i in 'blocks' consists
+	// of the runs from pvs[i] up to pvs[i + 1]. Otherwise, it is NULL.
+	uint32_t *pvs;
+	// The runs of PVSs, as pairs of the first index of a run in the layout
+	// of 'blocks' and the index after the last. These come after the offsets
+	// in the same allocation.
+	uint32_t *pvs_runs;
 	// The blocks of the boards. These are pointers to save space with many
-	// identical blocks.
+	// identical blocks. For palette boards, this is the palette instead.
 	const d3d_block_s *blocks[];
 };
 
+struct d3d_texture_atlas_s {
+	// Where the memory of the atlas comes from.
+	d3d_allocator_s alloc;
+	// The number of textures in the atlas.
+	size_t n_textures;
+	// The texture headers, which are next to each other. Their pixels come
+	// after them in the same allocation.
+	d3d_texture *textures;
+};
+
+struct d3d_level_s {
+	// The number of textures in the level.
+	size_t n_textures;
+	// The textures, with pixels pointing into the level data.
+	d3d_texture *textures;
+	// The palette of blocks, with faces pointing into 'textures'.
+	d3d_block_s *blocks;
+	// The palette board, with indices pointing into the level data.
+	d3d_board *board;
+};
+
+// A sprite in a sprite index.
+struct d3d_sprite_index_entry {
+	d3d_sprite_s sprite;
+	// The bucket of the sprite, or one of the values below.
+	size_t bucket;
+	// The neighbours of the entry in its bucket list, or (size_t)-1 at the
+	// ends. For free entries, next is the next free entry.
+	size_t prev, next;
+	// The last time the sprite was looked at while drawing.
+	unsigned long stamp;
+};
+
+// The bucket of a free entry.
+#define D3D_INDEX_FREE ((size_t)-1)
+// The bucket of a sprite outside the index.
+#define D3D_INDEX_OUTSIDE ((size_t)-2)
+
+struct d3d_sprite_index_s {
+	// Where the memory of the index comes from.
+	d3d_allocator_s alloc;
+	// The dimensions of the board, the side length of a bucket, and the
+	// dimensions of the grid of buckets.
+	size_t width, height, bucket_size, buckets_x, buckets_y;
+	// The first entry of each bucket, or (size_t)-1 for empty buckets, in
+	// the same layout as board blocks. These are glued on after the index.
+	size_t *heads;
+	// The entries, the number used or free, their capacity, the number of
+	// sprites, and the first free entry or (size_t)-1.
+	struct d3d_sprite_index_entry *entries;
+	size_t n_entries, entries_cap, n_sprites, free;
+	// The largest x scale of any sprite ever in the index, which is how far
+	// sprites can reach out of their buckets.
+	d3d_internal_scalar reach;
+	// This is increased each time the index is drawn.
+	unsigned long stamp;
+};
+
+struct d3d_pvs_s {
+	// Where the memory of the PVSs comes from.
+	d3d_allocator_s alloc;
+	// The width and height of the board.
+	size_t width, height;
+	// The columns of the board covered, as passed to d3d_new_pvs.
+	size_t first, step;
+	// The number of runs and the capacity of 'runs' in runs.
+	size_t n_runs, runs_cap;
+	// For the cells of the covered columns in order, the offsets into 'runs'
+	// where their PVSs start, with the end of the last one at the end.
+	uint32_t *offsets;
+	// Pairs of the first index of a run and the index after the last.
+	uint32_t *runs;
+};
+
+// A texture of a capture and its index in the capture.
+struct d3d_capture_texture {
+	const d3d_texture *txtr;
+	size_t index;
+};
+
+struct d3d_capture_s {
+	// Where the memory of the capture comes from.
+	d3d_allocator_s alloc;
+	// The file being written.
+	FILE *file;
+	// The number of captured textures.
+	size_t n_textures;
+	// The captured textures, sorted by address so they can be searched.
+	struct d3d_capture_texture *textures;
+	// Camera settings as written in the data. The first buffer holds the
+	// settings last written and the second is used to check for changes.
+	// Their sizes are in camera_sizes and their capacities in camera_caps.
+	// Nothing has been written yet if camera_sizes[0] is 0.
+	void *cameras[2];
+	size_t camera_sizes[2], camera_caps[2];
+};
+
+struct d3d_replay_s {
+	// Where the memory of the replay comes from.
+	d3d_allocator_s alloc;
+	// The capture data, its size, and the offset of the next record.
+	char *data;
+	size_t size, offset;
+	// The captured board and textures.
+	d3d_level *level;
+	// The camera, made from the last camera settings, or NULL at first.
+	d3d_camera *cam;
+	// The pose of the current frame.
+	d3d_vec_s pos;
+	d3d_scalar facing;
+	// The sprites of the current frame and the capacity of the array.
+	d3d_sprite_s *sprites;
+	size_t n_sprites, sprites_cap;
+	// The captured hash of the pixels of the current frame.
+	unsigned long long hash;
+};
+
+struct d3d_frame_differ_s {
+	// Where the memory of the differ comes from.
+	d3d_allocator_s alloc;
+	// The size of the frames compared.
+	size_t width, height;
+	// Nonzero once a frame has been remembered.
+	unsigned char primed;
+	// The last frame, laid out like camera pixels.
+	d3d_pixel *last;
+	// A row-major flag for each pixel which changed, and a flag for each
+	// row with changes. All of these are 0 between calls.
+	unsigned char *changed, *dirty_rows;
+	// Room for as many runs as a frame can have.
+	d3d_pixel_run_s *runs;
+};
+
+struct d3d_ansi_s {
+	// Where the memory of the renderer comes from.
+	d3d_allocator_s alloc;
+	// What finds the pixels to write.
+	d3d_frame_differ *differ;
+	// The number of pixel values with entries in the tables, and the
+	// tables, which are NULL if not given. These are glued on after the
+	// structure.
+	size_t n_mapped;
+	char *chars;
+	short *colors;
+	// The output buffer, which can hold the longest possible frame. It is
+	// glued on after the tables.
+	char *buf;
+};
+
+// A block of memory in an arena.
+struct d3d_arena_block {
+	// The next block, which was allocated earlier.
+	struct d3d_arena_block *next;
+	// The number of bytes after the header, and the number used so far.
+	size_t size, used;
+};
+
+struct d3d_arena_s {
+	// The smallest size of new blocks.
+	size_t block_size;
+	// The blocks, with the one being allocated from first.
+	struct d3d_arena_block *blocks;
+	// The latest allocation from the first block, or NULL.
+	void *last;
+};
+
 #endif /* defined(D3D_USE_INTERNAL_STRUCTS) && !defined(D3D_INTERNAL_H_) */
@@ -1,9 +1,13 @@
 #include "../d3d.h"
 #include <assert.h>
 #include <curses.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <tgmath.h>
 #include <time.h>
+#include <unistd.h>
 
 // Input keys for moving the camera:
 #define FORWARD_KEY 'w'
@@ -27,8 +31,8 @@
 // The number of tiles the room is wide:
 #define ROOM_WIDTH 3
 
-// The minimum distance the camera or a bat can be from the walls of the room:
-#define ROOM_PADDING ((d3d_scalar)0.2)
+// The minimum distance the camera or a bat can be from the walls:
+#define PADDING ((d3d_scalar)0.2)
 
 // The minimum number of milliseconds between frames:
 #define FRAME_DELAY 50
@@ -46,6 +50,29 @@
 // The number of bats in the room:
 #define N_BATS 3
 
+// In stress mode, the maze is this many cells wide and tall, with walls between
+// them, and this many bats fly around in it:
+#define STRESS_MAZE_CELLS 40
+#define STRESS_N_BATS 5000
+
+// The percent chance of knocking out a wall between two maze cells which are
+// already connected, so that the maze has loops and longer views:
+#define STRESS_LOOP_CHANCE 10
+
+// The size of the camera in headless mode, when there is no terminal:
+#define HEADLESS_WIDTH 160
+#define HEADLESS_HEIGHT 48
+
+// The speed at which the camera turns in headless mode as it walks forward:
+#define HEADLESS_TURN_SPEED ((d3d_scalar)0.01)
+
+// The number of frames over which the overlay takes percentiles:
+#define OVERLAY_SAMPLES 100
+
+// The width to which each line of the overlay is padded, so that it covers
+// whatever it covered last time:
+#define OVERLAY_WIDTH 56
+
 // The information for constructing the wall texture:
 #define WALL_WIDTH 6
 #define WALL_HEIGHT 6
@@ -99,18 +126,211 @@ d3d_texture *make_texture(size_t width, size_t height, const char *pixels)
 	return txtr;
 }
 
-int main(void)
+// The state of the random number generator below:
+static uint64_t random_state;
+
+// The largest number random_number returns:
+#define RANDOM_MAX 0xFFFFFFFFul
+
+// Get a random number. This is used instead of rand so that headless runs
+// place the same maze and bats with every C library:
+static unsigned long random_number(void)
+{
+	random_state = random_state * 6364136223846793005u
+		+ 1442695040888963407u;
+	return (unsigned long)(random_state >> 32);
+}
+
+// Carve a maze of cells by cells cells out of a board full of walls. The cell
+// (cx, cy) is the block (2 * cx + 1, 2 * cy + 1):
+static void carve_maze(d3d_board *board, d3d_block_s *empty, size_t cells)
+{
+	size_t n_cells = cells * cells;
+	bool *visited = calloc(n_cells, sizeof(*visited));
+	size_t *stack = malloc(n_cells * sizeof(*stack));
+	assert(visited && stack);
+	// Wander from the first cell, backtracking at dead ends:
+	size_t top = 0;
+	stack[top++] = 0;
+	visited[0] = true;
+	*d3d_board_get(board, 1, 1) = empty;
+	while (top > 0) {
+		size_t cell = stack[top - 1];
+		size_t cx = cell % cells, cy = cell / cells;
+		size_t options[4], n_options = 0;
+		if (cx > 0 && !visited[cell - 1])
+			options[n_options++] = cell - 1;
+		if (cx + 1 < cells && !visited[cell + 1])
+			options[n_options++] = cell + 1;
+		if (cy > 0 && !visited[cell - cells])
+			options[n_options++] = cell - cells;
+		if (cy + 1 < cells && !visited[cell + cells])
+			options[n_options++] = cell + cells;
+		if (n_options == 0) {
+			--top;
+			continue;
+		}
+		size_t next = options[random_number() % n_options];
+		size_t nx = next % cells, ny = next / cells;
+		// Carve the next cell and the wall between:
+		*d3d_board_get(board, cx + nx + 1, cy + ny + 1) = empty;
+		*d3d_board_get(board, 2 * nx + 1, 2 * ny + 1) = empty;
+		visited[next] = true;
+		stack[top++] = next;
+	}
+	// The walls between cells are where exactly one coordinate is even:
+	for (size_t x = 1; x < 2 * cells; ++x) {
+		for (size_t y = 1; y < 2 * cells; ++y) {
+			if ((x + y) % 2 == 1
+			 && random_number() % 100 < STRESS_LOOP_CHANCE)
+				*d3d_board_get(board, x, y) = empty;
+		}
+	}
+	free(stack);
+	free(visited);
+}
+
+// Check whether something at pos would be less than PADDING from a wall:
+static bool blocked(d3d_board *board, const d3d_block_s *wall, d3d_vec_s pos)
+{
+	for (int i = 0; i < 4; ++i) {
+		d3d_scalar x = pos.x + (i & 1 ? PADDING : -PADDING);
+		d3d_scalar y = pos.y + (i & 2 ? PADDING : -PADDING);
+		if (x < 0 || y < 0) return true;
+		const d3d_block_s **block =
+			d3d_board_get(board, (size_t)x, (size_t)y);
+		if (!block || *block == wall) return true;
+	}
+	return false;
+}
+
+static double seconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// A record of frame times, which keeps the latest cap times once full:
+struct samples {
+	double *times;
+	// The times sorted by sort_samples:
+	double *sorted;
+	size_t cap, n, next;
+};
+
+static void init_samples(struct samples *smp, size_t cap)
+{
+	smp->times = malloc(cap * sizeof(*smp->times));
+	smp->sorted = malloc(cap * sizeof(*smp->sorted));
+	assert(smp->times && smp->sorted);
+	smp->cap = cap;
+	smp->n = 0;
+	smp->next = 0;
+}
+
+static void add_sample(struct samples *smp, double time)
+{
+	smp->times[smp->next] = time;
+	smp->next = (smp->next + 1) % smp->cap;
+	if (smp->n < smp->cap) ++smp->n;
+}
+
+static int compar_double(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+	if (da > db) return 1;
+	if (da < db) return -1;
+	return 0;
+}
+
+// Sort the times into smp->sorted and return their sum:
+static double sort_samples(struct samples *smp)
+{
+	double total = 0.0;
+	for (size_t i = 0; i < smp->n; ++i) {
+		total += smp->times[i];
+	}
+	memcpy(smp->sorted, smp->times, smp->n * sizeof(*smp->sorted));
+	qsort(smp->sorted, smp->n, sizeof(*smp->sorted), compar_double);
+	return total;
+}
+
+// Get a percentile of the times sorted by sort_samples:
+static double percentile(const struct samples *smp, double p)
+{
+	size_t i = (size_t)(p / 100 * (double)(smp->n - 1) + 0.5);
+	return smp->sorted[i];
+}
+
+// Write a line of the overlay about some frame times in milliseconds:
+static void time_line(char *line, const char *label, struct samples *smp)
 {
-	// Initialize the screen:
-	initscr();
-	// Read one character at a time:
-	cbreak();
-	// Don't wait for user input:
-	timeout(0);
-	// Don't show input characters:
-	noecho();
-	// Don't show the cursor:
-	curs_set(0);
+	if (smp->n == 0) {
+		snprintf(line, OVERLAY_WIDTH + 1, "%s", label);
+		return;
+	}
+	sort_samples(smp);
+	double last = smp->times[(smp->next + smp->cap - 1) % smp->cap];
+	snprintf(line, OVERLAY_WIDTH + 1,
+		"%-8s%6.2f ms  p50 %6.2f  p90 %6.2f  p99 %6.2f", label,
+		last * 1e3, percentile(smp, 50) * 1e3,
+		percentile(smp, 90) * 1e3, percentile(smp, 99) * 1e3);
+}
+
+int main(int argc, char *argv[])
+{
+	// With -a, frames are written as ANSI escape sequences instead of
+	// through Curses, which is only used for input then. With -c and a file
+	// name, the session is captured to the file for the replay tool. With
+	// -i, an overlay shows how long frames take. With -s, thousands of bats
+	// fly around a big maze with no delay between frames, and the overlay
+	// is shown. With -H and a number of frames, nothing is displayed and the
+	// camera walks by itself; at the end, the times taken to draw the frames
+	// are printed:
+	bool use_ansi = false, overlay = false, stress = false;
+	bool headless = false;
+	size_t n_frames = 0;
+	const char *capture_path = NULL;
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "-a")) {
+			use_ansi = true;
+		} else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+			capture_path = argv[++i];
+		} else if (!strcmp(argv[i], "-i")) {
+			overlay = true;
+		} else if (!strcmp(argv[i], "-s")) {
+			stress = true;
+			overlay = true;
+		} else if (!strcmp(argv[i], "-H") && i + 1 < argc) {
+			headless = true;
+			n_frames = strtoul(argv[++i], NULL, 10);
+		} else {
+			fprintf(stderr, "Usage: %s [-a] [-c capture] [-i] [-s] "
+				"[-H frames]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (headless) {
+		use_ansi = false;
+		overlay = false;
+	}
+
+	if (!headless) {
+		// Initialize the screen:
+		initscr();
+		// Read one character at a time:
+		cbreak();
+		// Don't wait for user input:
+		timeout(0);
+		// Don't show input characters:
+		noecho();
+		// Don't show the cursor:
+		curs_set(0);
+		// Clear the screen now, so Curses has nothing left to draw
+		// later:
+		refresh();
+	}
 
 	// Initialize textures:
 	d3d_texture *wall_txtr =
@@ -120,6 +340,9 @@ int main(void)
 	d3d_texture *bat_txtr_1 =
 		make_texture(BAT_WIDTH, BAT_HEIGHT, bat_pixels[1]);
 
+	// The same bats fly the same way each time when profiling:
+	random_state = headless ? 1 : (uint64_t)time(NULL);
+
 	// Initialize board:
 	d3d_block_s empty_block = {{
 		NULL, NULL, NULL, NULL, wall_txtr, wall_txtr
@@ -127,26 +350,55 @@ int main(void)
 	d3d_block_s wall_block = {{
 		wall_txtr, wall_txtr, wall_txtr, wall_txtr, NULL, NULL
 	}};
-	// The +2 is to make room for the wall tiles:
+	// The +1 or +2 is to make room for the wall tiles:
+	size_t board_width =
+		stress ? 2 * STRESS_MAZE_CELLS + 1 : ROOM_WIDTH + 2;
 	d3d_board *board =
-		d3d_new_board(ROOM_WIDTH + 2, ROOM_WIDTH + 2, &wall_block);
+		d3d_new_board(board_width, board_width, &wall_block);
 	assert(board);
-	// Carve out the room from the middle:
-	for (size_t x = 1; x < ROOM_WIDTH + 1; ++x) {
-		for (size_t y = 1; y < ROOM_WIDTH + 1; ++y) {
-			*d3d_board_get(board, x, y) = &empty_block;
+	if (stress) {
+		carve_maze(board, &empty_block, STRESS_MAZE_CELLS);
+	} else {
+		// Carve out the room from the middle:
+		for (size_t x = 1; x < ROOM_WIDTH + 1; ++x) {
+			for (size_t y = 1; y < ROOM_WIDTH + 1; ++y) {
+				*d3d_board_get(board, x, y) = &empty_block;
+			}
 		}
 	}
 
 	// Initialize camera/viewpoint:
-	size_t cam_width = COLS > 0 ? (size_t)COLS : 1;
-	size_t cam_height = LINES > 0 ? (size_t)LINES : 1;
+	size_t cam_width = HEADLESS_WIDTH, cam_height = HEADLESS_HEIGHT;
+	if (!headless) {
+		cam_width = COLS > 0 ? (size_t)COLS : 1;
+		cam_height = LINES > 0 ? (size_t)LINES : 1;
+	}
 	d3d_camera *cam =
 		d3d_new_camera(FOV_X, FOV_Y, cam_width, cam_height, ' ');
-	// Start in the center:
+	// Only the pixels which changed are sent to the screen:
+	d3d_frame_differ *differ = d3d_new_frame_differ(cam_width, cam_height);
+	assert(differ);
+	d3d_ansi *ansi = NULL;
+	if (use_ansi) {
+		ansi = d3d_new_ansi(cam_width, cam_height, 0, NULL, NULL);
+		assert(ansi);
+	}
+	FILE *capture_file = NULL;
+	d3d_capture *capture = NULL;
+	if (capture_path) {
+		const d3d_texture *textures[] = {
+			wall_txtr, bat_txtr_0, bat_txtr_1
+		};
+		capture_file = fopen(capture_path, "wb");
+		assert(capture_file);
+		capture = d3d_new_capture(capture_file, board, 3, textures);
+		assert(capture);
+	}
+	// Start in the center of the room or the corner of the maze:
 	d3d_vec_s cam_pos = {
 		(d3d_scalar)ROOM_WIDTH / 2 + 1, (d3d_scalar)ROOM_WIDTH / 2 + 1
 	};
+	if (stress) cam_pos.x = cam_pos.y = (d3d_scalar)1.5;
 	d3d_scalar cam_facing = 0.0;
 
 	// Initialize bats:
@@ -157,59 +409,139 @@ int main(void)
 		bool frame_0;
 		// Ticks since last frame change:
 		unsigned since_change;
-	} bats[N_BATS];
+	};
+	size_t n_bats = stress ? STRESS_N_BATS : N_BATS;
+	struct bat *bats = malloc(n_bats * sizeof(*bats));
 	// This array will be partially initialized in this loop:
-	d3d_sprite_s bat_sprites[N_BATS];
-	srand((unsigned)time(NULL));
-	for (size_t i = 0; i < N_BATS; ++i) {
-		// Position them randonly in the room:
-		bats[i].pos.x = (d3d_scalar)1.5 + rand() % ROOM_WIDTH;
-		bats[i].pos.y = (d3d_scalar)1.5 + rand() % ROOM_WIDTH;
+	d3d_sprite_s *bat_sprites = malloc(n_bats * sizeof(*bat_sprites));
+	assert(bats && bat_sprites);
+	for (size_t i = 0; i < n_bats; ++i) {
+		if (stress) {
+			// Position them randomly in the maze cells:
+			d3d_scalar spread = 1 - 2 * PADDING;
+			size_t cx = random_number() % STRESS_MAZE_CELLS;
+			size_t cy = random_number() % STRESS_MAZE_CELLS;
+			bats[i].pos.x = 2 * cx + 1 + PADDING
+				+ (d3d_scalar)random_number() / RANDOM_MAX
+				* spread;
+			bats[i].pos.y = 2 * cy + 1 + PADDING
+				+ (d3d_scalar)random_number() / RANDOM_MAX
+				* spread;
+		} else {
+			// Position them randonly in the room:
+			bats[i].pos.x =
+				(d3d_scalar)1.5 + random_number() % ROOM_WIDTH;
+			bats[i].pos.y =
+				(d3d_scalar)1.5 + random_number() % ROOM_WIDTH;
+		}
 		// Face them in a random direction:
-		d3d_scalar facing = (d3d_scalar)rand() / RAND_MAX * 2 * PI;
+		d3d_scalar facing =
+			(d3d_scalar)random_number() / RANDOM_MAX * 2 * PI;
 		bats[i].vel.x = cos(facing) * BAT_SPEED;
 		bats[i].vel.y = sin(facing) * BAT_SPEED;
 		// Start with the zeroth frame:
 		bats[i].frame_0 = true;
 		// But desynchronize the flapping a bit:
-		bats[i].since_change = rand() % BAT_FRAME_DELAY;
+		bats[i].since_change = random_number() % BAT_FRAME_DELAY;
 		// Set up unchanging sprite information:
 		bat_sprites[i].scale.x = BAT_SCALE_X;
 		bat_sprites[i].scale.y = BAT_SCALE_Y;
 		bat_sprites[i].transparent = '_'; // See bat_pixels.
 	}
 
+	// The times taken to draw frames to the camera and to display them, in
+	// seconds. When headless, all the drawing times are kept:
+	struct samples render_times, display_times;
+	init_samples(&render_times, headless && n_frames > 0 ?
+		n_frames : OVERLAY_SAMPLES);
+	init_samples(&display_times, OVERLAY_SAMPLES);
+	// The total number of sprites drawn, for the headless summary:
+	size_t total_drawn = 0;
+
 	// Run the thing:
-	for (;;) {
+	for (size_t frame = 0; !headless || frame < n_frames; ++frame) {
 		// Draw the frame:
 		// Fill out the bat sprite information:
-		for (size_t i = 0; i < N_BATS; ++i) {
+		for (size_t i = 0; i < n_bats; ++i) {
 			bat_sprites[i].pos = bats[i].pos;
 			bat_sprites[i].txtr =
 				bats[i].frame_0 ? bat_txtr_0 : bat_txtr_1;
 		}
 		// Draw to the camera and transfer pixels to the screen:
-		d3d_draw(cam, cam_pos, cam_facing, board, N_BATS, bat_sprites);
-		for (size_t y = 0; y < cam_height; ++y) {
-			for (size_t x = 0; x < cam_width; ++x) {
-				mvaddch(y, x, *d3d_camera_get(cam, x, y));
+		double start = seconds();
+		if (capture) {
+			d3d_capture_draw(capture, cam, cam_pos, cam_facing,
+				board, n_bats, bat_sprites);
+		} else {
+			d3d_draw(cam, cam_pos, cam_facing, board, n_bats,
+				bat_sprites);
+		}
+		double rendered = seconds();
+		add_sample(&render_times, rendered - start);
+		size_t n_drawn = d3d_camera_sprites_drawn(cam);
+		total_drawn += n_drawn;
+		// The overlay lines are padded and cut to fit the screen:
+		char lines[3][OVERLAY_WIDTH + 1];
+		size_t line_len =
+			cam_width < OVERLAY_WIDTH ? cam_width : OVERLAY_WIDTH;
+		if (overlay) {
+			time_line(lines[0], "render", &render_times);
+			time_line(lines[1], "display", &display_times);
+			snprintf(lines[2], sizeof(lines[2]),
+				"sprites %zu of %zu drawn", n_drawn, n_bats);
+			for (int i = 0; i < 3; ++i) {
+				size_t len = strlen(lines[i]);
+				memset(lines[i] + len, ' ', OVERLAY_WIDTH - len);
 			}
 		}
-		refresh();
+		if (headless) {
+			// Nothing is displayed.
+		} else if (ansi) {
+			const char *text;
+			size_t len = d3d_ansi_frame(ansi, cam, &text);
+			if (write(STDOUT_FILENO, text, len) < 0) {
+				// Nothing can be done about it.
+			}
+			for (int i = 0; overlay && i < 3; ++i) {
+				char buf[OVERLAY_WIDTH + 16];
+				len = sprintf(buf, "\x1b[%d;1H%.*s", i + 1,
+					(int)line_len, lines[i]);
+				if (write(STDOUT_FILENO, buf, len) < 0) {
+					// Nothing can be done about it.
+				}
+			}
+		} else {
+			const d3d_pixel_run_s *runs;
+			size_t n_runs = d3d_diff_frame(differ, cam, &runs);
+			for (size_t i = 0; i < n_runs; ++i) {
+				move(runs[i].y, runs[i].x);
+				for (size_t j = 0; j < runs[i].len; ++j) {
+					addch(*d3d_camera_get(cam,
+						runs[i].x + j, runs[i].y));
+				}
+			}
+			for (int i = 0; overlay && i < 3; ++i) {
+				mvaddnstr(i, 0, lines[i], (int)line_len);
+			}
+			refresh();
+		}
+		add_sample(&display_times, seconds() - rendered);
 
-		// Put a delay between frames:
-		napms(FRAME_DELAY);
+		// Put a delay between frames, except when measuring:
+		if (!stress && !headless) napms(FRAME_DELAY);
 
-		// Take user input:
-		int key = getch();
+		// Take user input, or walk forward when headless:
+		int key = headless ? FORWARD_KEY : getch();
 		// Avoid building up input:
-		flushinp();
+		if (!headless) flushinp();
 		// Whether or not the user wants to step (translate position):
 		bool step = false;
 		// Offset from facing angle to determine the angle to step in:
 		d3d_scalar step_turn_amount;
 		// Amount to add to facing angle:
-		d3d_scalar turn_amount = 0.0;
+		d3d_scalar turn_amount = headless ? HEADLESS_TURN_SPEED : 0.0;
+		// Whether the user wants to quit:
+		bool quit = false;
 		switch (key) {
 		case FORWARD_KEY:
 			step = true;
@@ -234,61 +566,81 @@ int main(void)
 			turn_amount = +CAM_TURN_SPEED;
 			break;
 		case QUIT_KEY:
-			// PROGRAM ENDS HERE.
-			d3d_free_camera(cam);
-			d3d_free_board(board);
-			d3d_free_texture(bat_txtr_1);
-			d3d_free_texture(bat_txtr_0);
-			d3d_free_texture(wall_txtr);
-			endwin();
-			return EXIT_SUCCESS;
+			quit = true;
+			break;
 		}
+		if (quit) break;
 		if (step) {
-			// Step the camera:
+			// Step the camera, in each direction only if that does
+			// not go too near a wall:
 			d3d_scalar step_angle = cam_facing + step_turn_amount;
-			cam_pos.x += cos(step_angle) * CAM_SPEED;
-			cam_pos.y += sin(step_angle) * CAM_SPEED;
-			// Keep the camera in the room:
-			if (cam_pos.x < 1 + ROOM_PADDING)
-				cam_pos.x = 1 + ROOM_PADDING;
-			if (cam_pos.x > 1 + ROOM_WIDTH - ROOM_PADDING)
-				cam_pos.x = 1 + ROOM_WIDTH - ROOM_PADDING;
-			if (cam_pos.y < 1 + ROOM_PADDING)
-				cam_pos.y = 1 + ROOM_PADDING;
-			if (cam_pos.y > 1 + ROOM_WIDTH - ROOM_PADDING)
-				cam_pos.y = 1 + ROOM_WIDTH - ROOM_PADDING;
+			d3d_vec_s to = cam_pos;
+			to.x += cos(step_angle) * CAM_SPEED;
+			if (blocked(board, &wall_block, to)) to.x = cam_pos.x;
+			to.y += sin(step_angle) * CAM_SPEED;
+			if (blocked(board, &wall_block, to)) to.y = cam_pos.y;
+			cam_pos = to;
 		}
 		// Turn the camera:
 		cam_facing = fmod(cam_facing + turn_amount, 2 * PI);
 
 		// Move the bats:
-		for (size_t i = 0; i < N_BATS; ++i) {
+		for (size_t i = 0; i < n_bats; ++i) {
 			// Update the bat frame:
 			++bats[i].since_change;
 			if (bats[i].since_change >= BAT_FRAME_DELAY) {
 				bats[i].frame_0 = !bats[i].frame_0;
 				bats[i].since_change = 0;
 			}
-			// Move the bat:
-			bats[i].pos.x += bats[i].vel.x;
-			bats[i].pos.y += bats[i].vel.y;
-			// Keep the bat in the room and bounce it off the walls:
-			if (bats[i].pos.x < 1 + ROOM_PADDING) {
-				bats[i].pos.x = 1 + ROOM_PADDING;
+			// Move the bat, bouncing it off the walls:
+			d3d_vec_s to = bats[i].pos;
+			to.x += bats[i].vel.x;
+			if (blocked(board, &wall_block, to)) {
+				to.x = bats[i].pos.x;
 				bats[i].vel.x *= -1;
 			}
-			if (bats[i].pos.x > 1 + ROOM_WIDTH - ROOM_PADDING) {
-				bats[i].pos.x = 1 + ROOM_WIDTH - ROOM_PADDING;
-				bats[i].vel.x *= -1;
-			}
-			if (bats[i].pos.y < 1 + ROOM_PADDING) {
-				bats[i].pos.y = 1 + ROOM_PADDING;
-				bats[i].vel.y *= -1;
-			}
-			if (bats[i].pos.y > 1 + ROOM_WIDTH - ROOM_PADDING) {
-				bats[i].pos.y = 1 + ROOM_WIDTH - ROOM_PADDING;
+			to.y += bats[i].vel.y;
+			if (blocked(board, &wall_block, to)) {
+				to.y = bats[i].pos.y;
 				bats[i].vel.y *= -1;
 			}
+			bats[i].pos = to;
+		}
+	}
+
+	// PROGRAM ENDS HERE.
+	if (headless) {
+		size_t n = render_times.n;
+		double total = sort_samples(&render_times);
+		printf("%zu frames, %zu bats", n, n_bats);
+		if (n > 0) {
+			printf(" (ms per frame: mean %.3f, p50 %.3f, p90 %.3f, "
+				"p99 %.3f, max %.3f; %.1f sprites drawn per "
+				"frame)",
+				total / (double)n * 1e3,
+				percentile(&render_times, 50) * 1e3,
+				percentile(&render_times, 90) * 1e3,
+				percentile(&render_times, 99) * 1e3,
+				render_times.sorted[n - 1] * 1e3,
+				(double)total_drawn / (double)n);
 		}
+		printf("\n");
 	}
+	free(display_times.sorted);
+	free(display_times.times);
+	free(render_times.sorted);
+	free(render_times.times);
+	free(bat_sprites);
+	free(bats);
+	d3d_free_capture(capture);
+	if (capture_file) fclose(capture_file);
+	d3d_free_ansi(ansi);
+	d3d_free_frame_differ(differ);
+	d3d_free_camera(cam);
+	d3d_free_board(board);
+	d3d_free_texture(bat_txtr_1);
+	d3d_free_texture(bat_txtr_0);
+	d3d_free_texture(wall_txtr);
+	if (!headless) endwin();
+	return EXIT_SUCCESS;
 }
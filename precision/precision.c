@@ -0,0 +1,157 @@
+#include "../d3d.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The size of each frame:
+#define WIDTH 640
+#define HEIGHT 480
+
+// The number of frames drawn of each scene:
+#define N_FRAMES 100
+
+// One in this many blocks of a scene is a wall:
+#define WALL_RARITY 12
+
+#define USAGE "Usage: %s [-c]\n"
+
+// The scenes drawn, which are random boards of various sizes with the camera
+// in the middle. Far from the origin, single precision loses more:
+static const struct scene {
+	const char *name;
+	// The width and height of the board:
+	size_t size;
+	// The number of sprites scattered around the camera:
+	size_t n_sprites;
+} scenes[] = {
+	{ "64x64", 64, 0 },
+	{ "64x64 with sprites", 64, 500 },
+	{ "1000x1000", 1000, 0 },
+	{ "8000x8000", 8000, 0 },
+};
+
+#define N_SCENES (sizeof(scenes) / sizeof(*scenes))
+
+// Draw each frame of a scene with the camera, then either write it to stdout
+// or compare it to the one read from stdin. With comparison, *n_differing is
+// set to the number of pixels which differ. false is returned on failure:
+static bool run_scene(
+	const struct scene *sc,
+	d3d_camera *cam,
+	const d3d_texture *txtr,
+	bool compare,
+	size_t *n_differing)
+{
+	d3d_block_s empty = {{ NULL, NULL, NULL, NULL, txtr, txtr }};
+	d3d_block_s wall = {{ txtr, txtr, txtr, txtr, NULL, NULL }};
+	const d3d_block_s *palette[] = { &empty, &wall };
+	// A palette board keeps the biggest scene to one byte per block:
+	d3d_board *board = d3d_new_palette_board(sc->size, sc->size, 2,
+		palette);
+	d3d_sprite_s *sprites = malloc((sc->n_sprites ? sc->n_sprites : 1)
+		* sizeof(*sprites));
+	d3d_pixel *ref = malloc(WIDTH * HEIGHT * sizeof(*ref));
+	if (!board || !sprites || !ref) {
+		d3d_free_board(board);
+		free(sprites);
+		free(ref);
+		return false;
+	}
+	// Both builds use the same seed, so they draw the same scenes:
+	srand(2);
+	for (size_t i = 0; i < sc->size * sc->size / WALL_RARITY; ++i) {
+		d3d_board_set(board, rand() % sc->size, rand() % sc->size,
+			&wall);
+	}
+	d3d_board_accelerate(board);
+	d3d_scalar middle = (d3d_scalar)(sc->size / 2);
+	for (size_t i = 0; i < sc->n_sprites; ++i) {
+		sprites[i].pos.x = middle + (d3d_scalar)(rand() % 2000 - 1000)
+			/ 100;
+		sprites[i].pos.y = middle + (d3d_scalar)(rand() % 2000 - 1000)
+			/ 100;
+		sprites[i].scale.x = (d3d_scalar)0.2
+			+ (d3d_scalar)(rand() % 50) / 100;
+		sprites[i].scale.y = (d3d_scalar)0.3;
+		sprites[i].txtr = txtr;
+		sprites[i].transparent = 1;
+	}
+	bool ok = true;
+	*n_differing = 0;
+	for (size_t f = 0; f < N_FRAMES && ok; ++f) {
+		d3d_vec_s pos = {
+			middle + (d3d_scalar)0.37 + (d3d_scalar)(f % 10) / 10,
+			middle + (d3d_scalar)0.61
+		};
+		// Keep the camera out of walls:
+		d3d_board_set(board, (size_t)pos.x, (size_t)pos.y, &empty);
+		d3d_draw(cam, pos, (d3d_scalar)f * (d3d_scalar)0.063, board,
+			sc->n_sprites, sprites);
+		const d3d_pixel *pixels = d3d_camera_get(cam, 0, 0);
+		if (compare) {
+			if (fread(ref, sizeof(*ref), WIDTH * HEIGHT, stdin)
+				!= WIDTH * HEIGHT) {
+				ok = false;
+				break;
+			}
+			for (size_t p = 0; p < WIDTH * HEIGHT; ++p) {
+				*n_differing += pixels[p] != ref[p];
+			}
+		} else if (fwrite(pixels, sizeof(*pixels), WIDTH * HEIGHT,
+				stdout) != WIDTH * HEIGHT) {
+			ok = false;
+		}
+	}
+	free(ref);
+	free(sprites);
+	d3d_free_board(board);
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	bool compare = false;
+	if (argc == 2 && !strcmp(argv[1], "-c")) {
+		compare = true;
+	} else if (argc != 1) {
+		fprintf(stderr, USAGE, argv[0]);
+		return EXIT_FAILURE;
+	}
+	// A texture with a different pixel in each texel of a row or column,
+	// so that texture coordinates which are off show up:
+	d3d_texture *txtr = d3d_new_texture(64, 64, 0);
+	d3d_camera *cam = d3d_new_camera((d3d_scalar)2.0, (d3d_scalar)1.5,
+		WIDTH, HEIGHT, ' ');
+	if (!txtr || !cam) {
+		fprintf(stderr, "%s: out of memory\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	for (size_t x = 0; x < 64; ++x) {
+		for (size_t y = 0; y < 64; ++y) {
+			*d3d_texture_get(txtr, x, y) =
+				(d3d_pixel)((x * 7 + y) % 200 + 1);
+		}
+	}
+	int status = EXIT_SUCCESS;
+	for (size_t i = 0; i < N_SCENES; ++i) {
+		size_t n_differing;
+		if (!run_scene(&scenes[i], cam, txtr, compare, &n_differing)) {
+			fprintf(stderr, "%s: %s: %s\n", argv[0], scenes[i].name,
+				compare ? "could not read the reference frames"
+				: "could not draw or write the frames");
+			status = EXIT_FAILURE;
+			break;
+		}
+		if (compare) {
+			size_t n_pixels = (size_t)N_FRAMES * WIDTH * HEIGHT;
+			printf("%-20s %9zu of %9zu pixels differ (%.3f%%)\n",
+				scenes[i].name, n_differing, n_pixels,
+				100.0 * (double)n_differing / (double)n_pixels);
+		}
+	}
+	if (!compare && fflush(stdout) != 0) status = EXIT_FAILURE;
+	d3d_free_camera(cam);
+	d3d_free_texture(txtr);
+	return status;
+}
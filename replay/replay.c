@@ -0,0 +1,226 @@
+#include "../d3d.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define USAGE \
+	"Usage: %s [-c] [-r repeats] [-t times] [-p rays] [-j threads] capture\n"
+
+static double seconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// A thread computing part of the PVSs of a board:
+struct pvs_worker {
+	pthread_t thread;
+	const d3d_board *board;
+	size_t n_rays, first, step;
+	d3d_pvs *pvs;
+};
+
+static void *compute_pvs(void *arg)
+{
+	struct pvs_worker *w = arg;
+	w->pvs = d3d_new_pvs(w->board, w->n_rays, w->first, w->step);
+	return NULL;
+}
+
+// Give a board PVSs computed by n_threads threads, returning whether it worked.
+static bool use_pvs(d3d_board *board, size_t n_rays, long n_threads)
+{
+	struct pvs_worker *workers = calloc((size_t)n_threads, sizeof(*workers));
+	const d3d_pvs **parts = calloc((size_t)n_threads, sizeof(*parts));
+	bool ok = workers && parts;
+	long n_started = 0;
+	for (long i = 0; ok && i < n_threads; ++i) {
+		workers[i].board = board;
+		workers[i].n_rays = n_rays;
+		workers[i].first = (size_t)i;
+		workers[i].step = (size_t)n_threads;
+		if (pthread_create(&workers[i].thread, NULL, compute_pvs,
+				&workers[i])) {
+			ok = false;
+		} else {
+			++n_started;
+		}
+	}
+	for (long i = 0; i < n_started; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		parts[i] = workers[i].pvs;
+		if (!parts[i]) ok = false;
+	}
+	if (ok) ok = !d3d_board_use_pvs(board, (size_t)n_threads, parts);
+	for (long i = 0; i < n_started; ++i) {
+		d3d_free_pvs(workers[i].pvs);
+	}
+	free(parts);
+	free(workers);
+	return ok;
+}
+
+static int compar_double(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+	if (da > db) return 1;
+	if (da < db) return -1;
+	return 0;
+}
+
+// Get a percentile of some sorted times:
+static double percentile(const double *times, size_t n, double p)
+{
+	size_t i = (size_t)(p / 100 * (double)(n - 1) + 0.5);
+	return times[i];
+}
+
+int main(int argc, char *argv[])
+{
+	bool check = false;
+	long repeats = 1;
+	size_t pvs_rays = 0;
+	long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *times_path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "cr:t:p:j:")) != -1) {
+		switch (opt) {
+		case 'c':
+			check = true;
+			break;
+		case 'r':
+			repeats = strtol(optarg, NULL, 10);
+			break;
+		case 't':
+			times_path = optarg;
+			break;
+		case 'p':
+			pvs_rays = strtoul(optarg, NULL, 10);
+			break;
+		case 'j':
+			n_threads = strtol(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, USAGE, argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (argc - optind != 1) {
+		fprintf(stderr, USAGE, argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (repeats < 1) repeats = 1;
+	if (n_threads < 1) n_threads = 1;
+	const char *path = argv[optind];
+
+	// Map the capture privately, since replaying block changes writes to
+	// the board in it:
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+	size_t size = (size_t)st.st_size;
+	if (size == 0) {
+		fprintf(stderr, "%s: invalid capture\n", path);
+		return EXIT_FAILURE;
+	}
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+	d3d_replay *rp = d3d_load_replay(data, size);
+	if (!rp) {
+		fprintf(stderr, "%s: invalid capture\n", path);
+		return EXIT_FAILURE;
+	}
+	if (pvs_rays > 0) {
+		double start = seconds();
+		if (!use_pvs(d3d_replay_board(rp), pvs_rays, n_threads)) {
+			fprintf(stderr, "%s: could not compute PVSs\n", path);
+			return EXIT_FAILURE;
+		}
+		printf("PVSs computed in %.3f s with %ld threads\n",
+			seconds() - start, n_threads);
+	}
+	FILE *times_file = NULL;
+	if (times_path) {
+		times_file = fopen(times_path, "w");
+		if (!times_file) {
+			perror(times_path);
+			return EXIT_FAILURE;
+		}
+	}
+
+	// Replay every frame, keeping the fastest of the repeated draws:
+	double *times = NULL;
+	size_t n_frames = 0, times_cap = 0, n_mismatches = 0;
+	int status;
+	while ((status = d3d_replay_next(rp)) == 1) {
+		double best = 0.0;
+		for (long i = 0; i < repeats; ++i) {
+			double start = seconds();
+			d3d_replay_draw(rp);
+			double elapsed = seconds() - start;
+			if (i == 0 || elapsed < best) best = elapsed;
+		}
+		bool ok = !check || d3d_replay_check(rp);
+		if (!ok) ++n_mismatches;
+		if (times_file) {
+			fprintf(times_file, "%zu %.1f%s\n", n_frames, best * 1e6,
+				ok ? "" : " mismatch");
+		}
+		if (n_frames >= times_cap) {
+			times_cap = times_cap ? times_cap * 2 : 256;
+			double *new_times =
+				realloc(times, times_cap * sizeof(*times));
+			if (!new_times) {
+				perror(argv[0]);
+				return EXIT_FAILURE;
+			}
+			times = new_times;
+		}
+		times[n_frames++] = best;
+	}
+	if (status < 0) {
+		fprintf(stderr, "%s: invalid capture at frame %zu\n", path,
+			n_frames);
+	}
+
+	// Summarize the times in microseconds:
+	double total = 0.0;
+	for (size_t i = 0; i < n_frames; ++i) {
+		total += times[i];
+	}
+	printf("%zu frames in %.3f ms", n_frames, total * 1e3);
+	if (n_frames > 0) {
+		qsort(times, n_frames, sizeof(*times), compar_double);
+		printf(" (us per frame: mean %.1f, p50 %.1f, p90 %.1f, "
+			"p99 %.1f, max %.1f)",
+			total / (double)n_frames * 1e6,
+			percentile(times, n_frames, 50) * 1e6,
+			percentile(times, n_frames, 90) * 1e6,
+			percentile(times, n_frames, 99) * 1e6,
+			times[n_frames - 1] * 1e6);
+	}
+	printf("\n");
+	if (check) printf("%zu frames did not match\n", n_mismatches);
+
+	if (times_file) fclose(times_file);
+	free(times);
+	d3d_free_replay(rp);
+	munmap(data, size);
+	return status < 0 || n_mismatches > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}